@@ -8,19 +8,6 @@
 #include <smp/cpu.h>
 #include <std/move.h>
 
-struct acpi_rsdt_header_t
-{
-    char signature[4];
-    uint32_t length;
-    uint8_t revision;
-    uint8_t checksum;
-    char oem_id[6];
-    char oem_table_id[8];
-    uint32_t oem_revision;
-    uint32_t creator_id;
-    uint32_t creator_revision;
-};
-
 struct acpi_rsdt_t
 {
     acpi_rsdt_header_t header;
@@ -180,6 +167,36 @@ void do_init(RSDP *rsdp)
     }
 }
 
+template <class SDT_TYPE>
+static acpi_rsdt_header_t *do_find(RSDP *rsdp, const char *signature)
+{
+    auto rsdt = (SDT_TYPE *)rsdp->RSDTAddress();
+    auto entry_len = (rsdt->header.length - sizeof(rsdt->header)) / sizeof(decltype(*rsdt->other_sdt));
+    for (uint64_t i = 0; i < entry_len; ++i)
+    {
+        auto other = (typename SDT_TYPE::entry_type) & rsdt->other_sdt;
+        auto entry = (acpi_rsdt_header_t *)Phy_To_Virt(other[i]);
+        if (!strncmp(entry->signature, signature, 4))
+            return entry;
+    }
+    return nullptr;
+}
+
+acpi_rsdt_header_t *RSDT::FindTable(const char *signature)
+{
+    auto rsdp = RSDP::GetInstance();
+
+    switch (rsdp->ACPIVersion())
+    {
+    case 1:
+        return do_find<acpi_rsdt_t>(rsdp, signature);
+    case 2:
+        return do_find<acpi_xsdt_t>(rsdp, signature);
+    default:
+        return nullptr;
+    }
+}
+
 void RSDT::Init()
 {
     auto rsdp = RSDP::GetInstance();
@@ -2,8 +2,24 @@
 #include <std/stdint.h>
 #include <std/singleton.h>
 
+struct acpi_rsdt_header_t
+{
+    char signature[4];
+    uint32_t length;
+    uint8_t revision;
+    uint8_t checksum;
+    char oem_id[6];
+    char oem_table_id[8];
+    uint32_t oem_revision;
+    uint32_t creator_id;
+    uint32_t creator_revision;
+};
+
 class RSDT : public Singleton<RSDT>
 {
 public:
     void Init();
+    // virtual address of the table with signature, nullptr if absent
+    // only needs RSDP, so it can be used before Init
+    acpi_rsdt_header_t *FindTable(const char *signature);
 };
\ No newline at end of file
@@ -0,0 +1,146 @@
+#include "srat.h"
+#include "rsdt.h"
+#include <std/printk.h>
+
+struct acpi_srat_t
+{
+    acpi_rsdt_header_t header;
+    uint32_t reserved0;
+    uint64_t reserved1;
+    int8_t entry_start[0];
+    struct entry
+    {
+        uint8_t type;
+        uint8_t length;
+    } __attribute__((packed));
+    struct processor_local_apic_affinity_entry
+    {
+        entry header;
+        uint8_t proximity_domain_low;
+        uint8_t apic_id;
+        uint32_t flags;
+        uint8_t local_sapic_eid;
+        uint8_t proximity_domain_high[3];
+        uint32_t clock_domain;
+    } __attribute__((packed));
+    struct memory_affinity_entry
+    {
+        entry header;
+        uint32_t proximity_domain;
+        uint16_t reserved0;
+        uint64_t base_address;
+        uint64_t length;
+        uint32_t reserved1;
+        uint32_t flags;
+        uint64_t reserved2;
+    } __attribute__((packed));
+    struct processor_x2apic_affinity_entry
+    {
+        entry header;
+        uint16_t reserved0;
+        uint32_t proximity_domain;
+        uint32_t x2apic_id;
+        uint32_t flags;
+        uint32_t clock_domain;
+        uint32_t reserved1;
+    } __attribute__((packed));
+} __attribute__((packed));
+
+// flags bit 0 of every affinity entry
+#define SRAT_ENTRY_ENABLED 0x1
+
+void SRAT::Init()
+{
+    auto srat = (acpi_srat_t *)RSDT::GetInstance()->FindTable("SRAT");
+    if (!srat)
+    {
+        printk("no SRAT, single node\n");
+        return;
+    }
+
+    printk("find SRAT\n");
+    auto end_addr = (int8_t *)srat + srat->header.length;
+    auto start_addr = srat->entry_start;
+    while (start_addr < end_addr)
+    {
+        auto ent = (acpi_srat_t::entry *)start_addr;
+        if (ent->length == 0)
+            break;
+        switch (ent->type)
+        {
+        // Processor Local APIC/SAPIC Affinity
+        case 0:
+        {
+            auto plaae = (acpi_srat_t::processor_local_apic_affinity_entry *)ent;
+            if (!(plaae->flags & SRAT_ENTRY_ENABLED))
+                break;
+            uint32_t node = plaae->proximity_domain_low |
+                            plaae->proximity_domain_high[0] << 8 |
+                            plaae->proximity_domain_high[1] << 16 |
+                            plaae->proximity_domain_high[2] << 24;
+            printk("apic %d on node %d\n", plaae->apic_id, node);
+            this->apic_nodes[plaae->apic_id] = node;
+            break;
+        }
+        // Memory Affinity
+        case 1:
+        {
+            auto mae = (acpi_srat_t::memory_affinity_entry *)ent;
+            if (!(mae->flags & SRAT_ENTRY_ENABLED) || mae->length == 0)
+                break;
+            if (this->memory_range_count == SRAT_MEMORY_RANGE_MAX)
+            {
+                printk("too many SRAT memory ranges, ignored\n");
+                break;
+            }
+            printk("memory %p - %p on node %d\n", mae->base_address, mae->base_address + mae->length, mae->proximity_domain);
+            auto &range = this->memory_ranges[this->memory_range_count++];
+            range.start = mae->base_address;
+            range.end = mae->base_address + mae->length;
+            range.node = mae->proximity_domain;
+            break;
+        }
+        // Processor Local x2APIC Affinity
+        case 2:
+        {
+            auto pxae = (acpi_srat_t::processor_x2apic_affinity_entry *)ent;
+            if (!(pxae->flags & SRAT_ENTRY_ENABLED) || pxae->x2apic_id >= SRAT_APIC_MAX)
+                break;
+            this->apic_nodes[pxae->x2apic_id] = pxae->proximity_domain;
+            break;
+        }
+        default:
+            break;
+        }
+        start_addr += ent->length;
+    }
+}
+
+uint32_t SRAT::NodeOf(uint64_t physical_address)
+{
+    for (uint64_t i = 0; i < this->memory_range_count; ++i)
+    {
+        auto &range = this->memory_ranges[i];
+        if (range.start <= physical_address && physical_address < range.end)
+            return range.node;
+    }
+    return 0;
+}
+
+uint32_t SRAT::NodeOfApic(uint64_t apic_id)
+{
+    return apic_id < SRAT_APIC_MAX ? this->apic_nodes[apic_id] : 0;
+}
+
+uint64_t SRAT::NodeBoundary(uint64_t physical_address, uint64_t end)
+{
+    for (uint64_t i = 0; i < this->memory_range_count; ++i)
+    {
+        auto &range = this->memory_ranges[i];
+        if (range.start > physical_address && range.start < end)
+            end = range.start;
+        if (range.end > physical_address && range.end < end)
+            end = range.end;
+    }
+    return end;
+}
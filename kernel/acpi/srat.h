@@ -0,0 +1,32 @@
+#pragma once
+#include <std/stdint.h>
+#include <std/singleton.h>
+
+// memory ranges and apic ids tracked from the SRAT
+#define SRAT_MEMORY_RANGE_MAX 64
+#define SRAT_APIC_MAX 256
+
+// proximity domains from the System Resource Affinity Table
+// without a SRAT everything sits on node 0
+class SRAT : public Singleton<SRAT>
+{
+public:
+    void Init();
+
+    uint32_t NodeOf(uint64_t physical_address);
+    uint32_t NodeOfApic(uint64_t apic_id);
+    // first node boundary in (physical_address, end), end if there is none
+    uint64_t NodeBoundary(uint64_t physical_address, uint64_t end);
+
+private:
+    struct MemoryRange
+    {
+        uint64_t start;
+        uint64_t end;
+        uint32_t node;
+    };
+
+    MemoryRange memory_ranges[SRAT_MEMORY_RANGE_MAX];
+    uint64_t memory_range_count;
+    uint32_t apic_nodes[SRAT_APIC_MAX];
+};
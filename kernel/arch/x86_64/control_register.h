@@ -7,5 +7,6 @@
 
 #define CONTROL_REGISTER4_PAGE_SIZE_EXTENSION (1 << 4)
 #define CONTROL_REGISTER4_PHYSICAL_ADDRESS_EXTENSION (1 << 5)
+#define CONTROL_REGISTER4_PAGE_GLOBAL_ENABLE (1 << 7)
 
 #endif // _ARCH_X86_64_CONTROL_REGISTER_H_
@@ -18,6 +18,6 @@
    CONTROL_REGISTER0_PROTECTED_MODE_ENABLED |                                  \
    CONTROL_REGISTER0_EXTENSION_TYPE                                            \
   )
-#define KERNEL_CR4 (CONTROL_REGISTER4_PHYSICAL_ADDRESS_EXTENSION)
+#define KERNEL_CR4 (CONTROL_REGISTER4_PHYSICAL_ADDRESS_EXTENSION | CONTROL_REGISTER4_PAGE_GLOBAL_ENABLE)
 
 #endif // _ARCH_X86_64_KERNEL_H_
@@ -0,0 +1,243 @@
+#include "benchmark.h"
+#include <memory/buddy.h>
+#include <memory/kmalloc.h>
+#include <memory/tlb.h>
+#include <smp/cpu.h>
+#include <std/bitmap.h>
+#include <std/cpu_features.h>
+#include <std/kstring.h>
+#include <std/msr.h>
+#include <std/new.h>
+#include <std/printk.h>
+#include <time/ktime.h>
+
+// pages managed by the scratch buddy engines, no real memory behind them
+#define BUDDY_BENCH_PAGES (1 << 15)
+#define BUDDY_BENCH_ROUNDS 4
+
+template <typename Engine>
+static void buddy_benchmark(const char *name, Page *pages, int64_t *indices)
+{
+    auto metadata = (uint8_t *)kmalloc(Engine::MetadataSize(BUDDY_BENCH_PAGES) + 1, 0);
+    Engine engine;
+    engine.Init(metadata, pages, BUDDY_BENCH_PAGES, 0);
+
+    uint64_t ops = 0;
+    uint64_t start = rdtsc();
+    for (int round = 0; round < BUDDY_BENCH_ROUNDS; ++round)
+    {
+        // single pages, the page fault pattern
+        for (int i = 0; i < BUDDY_BENCH_PAGES; ++i)
+            indices[i] = engine.Allocate(1);
+        // free every other page first so merges happen late
+        for (int i = 0; i < BUDDY_BENCH_PAGES; i += 2)
+            engine.Free(indices[i]);
+        for (int i = 1; i < BUDDY_BENCH_PAGES; i += 2)
+            engine.Free(indices[i]);
+        ops += BUDDY_BENCH_PAGES * 2;
+
+        // mixed orders freed in reverse
+        int count = BUDDY_BENCH_PAGES / 16;
+        for (int i = 0; i < count; ++i)
+            indices[i] = engine.Allocate(1 << (i % 4));
+        for (int i = count - 1; i >= 0; --i)
+            engine.Free(indices[i]);
+        ops += count * 2;
+    }
+    uint64_t cycles = rdtsc() - start;
+
+    printk("buddy %s: %u cycles per op\n", name, cycles / ops);
+    kfree(metadata);
+}
+
+static void buddy_engines_benchmark()
+{
+    auto pages = (Page *)kmalloc(sizeof(Page) * BUDDY_BENCH_PAGES, 0);
+    auto indices = (int64_t *)kmalloc(sizeof(int64_t) * BUDDY_BENCH_PAGES, 0);
+
+    buddy_benchmark<BuddyTree>("tree", pages, indices);
+    buddy_benchmark<BuddyFreeList>("free list", pages, indices);
+
+    kfree(indices);
+    kfree(pages);
+}
+
+// bytes of the scratch bitmap, 32k bits
+#define BITMAP_BENCH_SIZE 4096
+#define BITMAP_BENCH_ROUNDS 64
+
+static void bitmap_benchmark()
+{
+    auto bitmap = new (kmalloc(Bitmap::AllocSize(BITMAP_BENCH_SIZE), 0)) Bitmap(BITMAP_BENCH_SIZE, true);
+    auto bits = bitmap->BitSize();
+    // only the last bit is free, the worst case of a search
+    bitmap->SetRange(0, bits - 1);
+
+    uint64_t found = 0;
+    uint64_t start = rdtsc();
+    for (int round = 0; round < BITMAP_BENCH_ROUNDS; ++round)
+    {
+        for (uint32_t i = 0; i < bits; ++i)
+        {
+            if (!bitmap->IsSet(i))
+            {
+                found += i;
+                break;
+            }
+        }
+    }
+    uint64_t bit_cycles = rdtsc() - start;
+
+    start = rdtsc();
+    for (int round = 0; round < BITMAP_BENCH_ROUNDS; ++round)
+        found += bitmap->FindFirstZero();
+    uint64_t word_cycles = rdtsc() - start;
+    printk("bitmap find zero: %u cycles per bit loop, %u per word search\n",
+           bit_cycles / BITMAP_BENCH_ROUNDS, word_cycles / BITMAP_BENCH_ROUNDS);
+
+    start = rdtsc();
+    for (int round = 0; round < BITMAP_BENCH_ROUNDS; ++round)
+    {
+        for (uint32_t i = 0; i < bits; ++i)
+            bitmap->UnSet(i);
+        for (uint32_t i = 0; i < bits; ++i)
+            found += bitmap->IsSet(i);
+    }
+    bit_cycles = rdtsc() - start;
+
+    start = rdtsc();
+    for (int round = 0; round < BITMAP_BENCH_ROUNDS; ++round)
+    {
+        bitmap->UnSetRange(0, bits);
+        found += bitmap->Count();
+    }
+    word_cycles = rdtsc() - start;
+    printk("bitmap clear and count: %u cycles per bit loop, %u per word ops (%u)\n",
+           bit_cycles / BITMAP_BENCH_ROUNDS, word_cycles / BITMAP_BENCH_ROUNDS, found);
+
+    kfree(bitmap);
+}
+
+// 256k stays in l2 on most cpus, the copies measure the routine not dram
+#define KSTRING_BENCH_SIZE (256 * 1024)
+#define KSTRING_BENCH_ROUNDS 64
+
+// MB/s from bytes moved in cycles
+static uint64_t bandwidth(uint64_t bytes, uint64_t cycles, uint64_t tsc_khz)
+{
+    return bytes * tsc_khz / 1000 / (cycles ? cycles : 1);
+}
+
+static void kstring_benchmark()
+{
+    uint64_t tsc_khz = ktime_tsc_khz();
+    uint64_t start;
+
+    auto dst = (uint8_t *)kmalloc(KSTRING_BENCH_SIZE, 0);
+    auto src = (uint8_t *)kmalloc(KSTRING_BENCH_SIZE, 0);
+    uint64_t bytes = (uint64_t)KSTRING_BENCH_SIZE * KSTRING_BENCH_ROUNDS;
+
+    const char *names[] = {"generic", "erms", "sse2", "avx2"};
+    memcpy_fn copies[] = {memcpy_generic, memcpy_erms, memcpy_sse2, memcpy_avx2};
+    memset_fn sets[] = {memset_generic, memset_erms, memset_sse2, memset_avx2};
+    // rep movsb works everywhere, erms only says it is fast
+    bool usable[] = {true, true, true, cpu_has(CPU_FEATURE_AVX2)};
+
+    for (int variant = 0; variant < 4; ++variant)
+    {
+        if (!usable[variant])
+            continue;
+
+        start = rdtsc();
+        for (int round = 0; round < KSTRING_BENCH_ROUNDS; ++round)
+            copies[variant](dst, src, KSTRING_BENCH_SIZE);
+        uint64_t copy_cycles = rdtsc() - start;
+
+        start = rdtsc();
+        for (int round = 0; round < KSTRING_BENCH_ROUNDS; ++round)
+            sets[variant](dst, round, KSTRING_BENCH_SIZE);
+        uint64_t set_cycles = rdtsc() - start;
+
+        printk("memcpy %s: %u MB/s, memset %s: %u MB/s\n",
+               names[variant], bandwidth(bytes, copy_cycles, tsc_khz),
+               names[variant], bandwidth(bytes, set_cycles, tsc_khz));
+    }
+
+    start = rdtsc();
+    for (int round = 0; round < KSTRING_BENCH_ROUNDS; ++round)
+        bzero_nt(dst, KSTRING_BENCH_SIZE);
+    printk("bzero_nt: %u MB/s\n", bandwidth(bytes, rdtsc() - start, tsc_khz));
+
+    kfree(src);
+    kfree(dst);
+}
+
+// pages of the scratch range, twice the full flush threshold
+#define SHOOTDOWN_BENCH_PAGES (TLB_FLUSH_THRESHOLD * 2)
+#define SHOOTDOWN_BENCH_ROUNDS 16
+#define SHOOTDOWN_BENCH_BASE 0x400000UL
+
+static void shootdown_benchmark()
+{
+    // every online ap pretends to run a scratch mm so each shootdown sends ipis
+    mm_struct mm;
+    memset(&mm, 0, sizeof(mm));
+    uint64_t targets = 0;
+    auto &cpus = CPU::GetInstance()->GetAll();
+    for (int i = 0; i < cpus.size(); ++i)
+    {
+        if (!cpus[i].online || &cpus[i] == this_cpu)
+            continue;
+        cpus[i].active_mm = &mm;
+        cpu_mask_test_and_set(mm.cpu_mask, cpus[i].apic_id);
+        ++targets;
+    }
+    if (!targets)
+    {
+        printk("tlb shootdown: no ap online, skipped\n");
+        return;
+    }
+
+    uint64_t start = rdtsc();
+    for (int round = 0; round < SHOOTDOWN_BENCH_ROUNDS; ++round)
+    {
+        for (uint64_t i = 0; i < TLB_BATCH_MAX; ++i)
+            tlb_shootdown(&mm, (void *)(SHOOTDOWN_BENCH_BASE + i * PAGE_4K_SIZE), PAGE_4K_SIZE);
+    }
+    uint64_t single_cycles = rdtsc() - start;
+
+    TlbBatch batch;
+    tlb_batch_init(&batch, &mm);
+    start = rdtsc();
+    for (int round = 0; round < SHOOTDOWN_BENCH_ROUNDS; ++round)
+    {
+        for (uint64_t i = 0; i < TLB_BATCH_MAX; ++i)
+            tlb_batch_add(&batch, (void *)(SHOOTDOWN_BENCH_BASE + i * PAGE_4K_SIZE), PAGE_4K_SIZE);
+        tlb_batch_flush(&batch);
+    }
+    uint64_t batch_cycles = rdtsc() - start;
+
+    start = rdtsc();
+    for (int round = 0; round < SHOOTDOWN_BENCH_ROUNDS; ++round)
+        tlb_shootdown(&mm, (void *)SHOOTDOWN_BENCH_BASE, SHOOTDOWN_BENCH_PAGES * PAGE_4K_SIZE);
+    uint64_t full_cycles = rdtsc() - start;
+
+    uint64_t pages = TLB_BATCH_MAX * SHOOTDOWN_BENCH_ROUNDS;
+    printk("tlb shootdown to %u cpus: %u cycles per page one by one, %u batched, %u full flush\n",
+           targets, single_cycles / pages, batch_cycles / pages,
+           full_cycles / (SHOOTDOWN_BENCH_PAGES * SHOOTDOWN_BENCH_ROUNDS));
+
+    for (int i = 0; i < cpus.size(); ++i)
+    {
+        if (cpus[i].active_mm == &mm)
+            cpus[i].active_mm = nullptr;
+    }
+}
+
+void benchmark_run()
+{
+    kstring_benchmark();
+    buddy_engines_benchmark();
+    bitmap_benchmark();
+    shootdown_benchmark();
+}
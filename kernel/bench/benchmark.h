@@ -0,0 +1,5 @@
+#pragma once
+
+// boot time micro benchmarks, only built with MOS_BENCHMARK
+// results go to printk in cycles, nothing else depends on them
+void benchmark_run();
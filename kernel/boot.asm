@@ -4,8 +4,10 @@ KERNEL_TEXT_BASE equ 0xFFFFFFFF00000000
 %define PAGE_WRITE      (1 << 1)
 %define PAGE_USER       (1 << 2)
 %define PAGE_1GB       (1 << 7)
+%define PAGE_GLOBAL    (1 << 8)
 %define CONTROL_REGISTER4_PHYSICAL_ADDRESS_EXTENSION (1 << 5)
-%define KERNEL_CR4 (CONTROL_REGISTER4_PHYSICAL_ADDRESS_EXTENSION)
+%define CONTROL_REGISTER4_PAGE_GLOBAL_ENABLE (1 << 7)
+%define KERNEL_CR4 (CONTROL_REGISTER4_PHYSICAL_ADDRESS_EXTENSION | CONTROL_REGISTER4_PAGE_GLOBAL_ENABLE)
 %define MSR_EFER 0xC0000080
 %define MSR_EFER_LME (1 << 8)
 %define MSR_EFER_SCE (1 << 0)
@@ -152,7 +154,7 @@ _start:
     mov [pdpe_low], eax
 
     mov eax, 0x0
-    or  eax, (PAGE_PRESENT | PAGE_WRITE | PAGE_1GB)
+    or  eax, (PAGE_PRESENT | PAGE_WRITE | PAGE_1GB | PAGE_GLOBAL)
     mov [pdpe + 0xfe0], eax
     
     mov eax, pte
@@ -10,6 +10,8 @@
 #include <thread/scheduler.h>
 #include <smp/cpu.h>
 #include <memory/kmalloc.h>
+#include <std/cpu_features.h>
+#include <time/ktime.h>
 
 static void timer_callback(uint64_t error_code, uint64_t rsp, uint64_t rflags, uint64_t rip)
 {
@@ -103,19 +105,57 @@ void APIC::EOI()
     apic_write(APIC_EOI, 0);
 }
 
+// measured with ktime, the tsc is precise enough for a short window
+#define TIMER_CALIBRATE_MS 10
+
 void APIC::timer_init()
 {
     apic_write(APIC_TIMER_DCR, 0x0);
-    apic_write(APIC_TIMER_ICR, 0xFFFFFFFF);
-    static uint32_t ticks = 0xFFFFFFFF - apic_read(APIC_TIMER_CCR);
     if (!this->inited)
     {
-        pit_spin(50);
+        // the aps share the numbers of the bsp
+        apic_write(APIC_TIMER_ICR, 0xFFFFFFFF);
+        auto start = ktime_get_ns();
+        while (ktime_get_ns() - start < TIMER_CALIBRATE_MS * NSEC_PER_MSEC)
+            asm volatile("pause");
+        this->apic_khz = (0xFFFFFFFF - apic_read(APIC_TIMER_CCR)) / TIMER_CALIBRATE_MS;
+        apic_write(APIC_TIMER_ICR, 0);
+        printk("lapic timer: %u khz\n", this->apic_khz);
     }
 
-    // Start timer as periodic on IRQ 0, divider 16, with the number of ticks we counted
-    apic_write(APIC_LVT_TIMER, IRQ0 | APIC_TIMER_PERIODIC);
-    apic_write(APIC_TIMER_ICR, ticks);
+    // one shot on IRQ0, stopped until the scheduler arms it
+    if (cpu_has(CPU_FEATURE_TSC_DEADLINE))
+        apic_write(APIC_LVT_TIMER, IRQ0 | APIC_TIMER_TSC_DEADLINE);
+    else
+        apic_write(APIC_LVT_TIMER, IRQ0 | APIC_TIMER_ONE_SHOT);
 
     IDT::GetInstance()->Register(IRQ0, timer_callback);
 }
+
+void APIC::TimerArm(uint64_t deadline)
+{
+    if (cpu_has(CPU_FEATURE_TSC_DEADLINE))
+    {
+        // 0 would disarm it
+        auto tsc = ktime_ns_to_tsc(deadline);
+        wrmsr(IA32_TSC_DEADLINE, tsc ? tsc : 1);
+        return;
+    }
+
+    auto now = ktime_get_ns();
+    auto delta = deadline > now ? deadline - now : 0;
+    uint64_t count = delta / NSEC_PER_MSEC * this->apic_khz + delta % NSEC_PER_MSEC * this->apic_khz / NSEC_PER_MSEC;
+    if (count == 0)
+        count = 1;
+    if (count > 0xFFFFFFFF)
+        count = 0xFFFFFFFF;
+    apic_write(APIC_TIMER_ICR, count);
+}
+
+void APIC::TimerStop()
+{
+    if (cpu_has(CPU_FEATURE_TSC_DEADLINE))
+        wrmsr(IA32_TSC_DEADLINE, 0);
+    else
+        apic_write(APIC_TIMER_ICR, 0);
+}
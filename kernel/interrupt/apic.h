@@ -71,9 +71,25 @@ public:
         this->apic_write(ICR_LOW, low);
     }
 
+    // one shot timer of this cpu, fires IRQ0 once ktime_get_ns reaches deadline
+    // a deadline in the past fires right away
+    void TimerArm(uint64_t deadline);
+    void TimerStop();
+
+    // fixed delivery of vector to one cpu
+    void SendIPI(uint64_t apic_id, uint8_t vector)
+    {
+        ICR_Register icr = {0};
+        icr.VEC = vector;
+        icr.DES = apic_id;
+        this->ICR_Write(&icr);
+    }
+
 private:
     bool inited = false;
     uint32_t *local_apic_base;
+    // lapic timer counts per ms, for the one shot mode without tsc deadline
+    uint64_t apic_khz = 0;
 
     inline uint32_t apic_read(uint32_t reg)
     {
@@ -6,6 +6,8 @@
 #include "keyboard.h"
 #include "apic.h"
 #include "page_fault.h"
+#include <memory/tlb.h>
+#include <smp/cpu.h>
 
 static interrupt_handler_t interrupt_handlers[INTERRUPT_MAX] __attribute__((aligned(8)));
 
@@ -71,6 +73,8 @@ extern "C"
     void irq13(); // 协处理器使用
     void irq14(); // IDE0 传输控制使用
     void irq15(); // IDE1 传输控制使用
+    void irq16(); // tlb shootdown ipi
+    void irq17(); // reschedule ipi
 }
 
 #define CONVERT_ISR_ADDR(i) (uint8_t*)(&isr##i)
@@ -150,9 +154,13 @@ void IDT::Init()
         set_intr_gate(45, 1, CONVERT_IRQ_ADDR(13));
         set_intr_gate(46, 1, CONVERT_IRQ_ADDR(14));
         set_intr_gate(47, 1, CONVERT_IRQ_ADDR(15));
+        set_intr_gate(IPI_TLB_SHOOTDOWN, 1, CONVERT_IRQ_ADDR(16));
+        set_intr_gate(IPI_RESCHEDULE, 1, CONVERT_IRQ_ADDR(17));
 
         this->Register(14, page_fault_handler);
         this->Register(IRQ1, keyboard_irq_handler);
+        this->Register(IPI_TLB_SHOOTDOWN, tlb_shootdown_handler);
+        this->Register(IPI_RESCHEDULE, reschedule_ipi_handler);
 
         /*                   ____________                          ____________
         Real Time Clock --> |            |   Timer -------------> |            |
@@ -236,6 +244,9 @@ extern "C" void irq_handler(uint64_t irq_number, uint64_t error_code, uint64_t r
         static auto apic = APIC::GetInstance();
         apic->EOI();
         interrupt_handlers[irq_number](error_code, rsp, rflags, rip);
+        // the handler woke a task that should run before the interrupted one
+        if (this_cpu->scheduler.NeedResched())
+            this_cpu->scheduler.Schedule();
     }
     else
     {
@@ -2,7 +2,7 @@
 #include <std/stdint.h>
 #include <std/singleton.h>
 
-#define INTERRUPT_MAX 48
+#define INTERRUPT_MAX 50
 
 #define IRQ0 32  // 电脑系统计时器
 #define IRQ1 33  // 键盘
@@ -21,6 +21,10 @@
 #define IRQ14 46 // IDE0 传输控制使用
 #define IRQ15 47 // IDE1 传输控制使用
 
+// vectors of inter processor interrupts
+#define IPI_TLB_SHOOTDOWN 48
+#define IPI_RESCHEDULE 49
+
 typedef void (*interrupt_handler_t)(uint64_t error_code, uint64_t rsp, uint64_t rflags, uint64_t rip);
 
 class IDT : public Singleton<IDT>
@@ -28,6 +28,8 @@ IRQ  12,    44  ; 接 PS/2 鼠标，也可设定给其他硬件
 IRQ  13,    45  ; 协处理器使用
 IRQ  14,    46  ; IDE0 传输控制使用
 IRQ  15,    47  ; IDE1 传输控制使用
+IRQ  16,    48  ; tlb shootdown ipi
+IRQ  17,    49  ; reschedule ipi
 
 extern int_ret
 extern int_with_ec
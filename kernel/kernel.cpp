@@ -21,6 +21,9 @@
 #include <std/string.h>
 #include <std/unordered_set.h>
 #include <pci/io.h>
+#include <bench/benchmark.h>
+#include <time/ktime.h>
+#include <std/cpu_features.h>
 
 class SP
 {
@@ -30,11 +33,20 @@ public:
 
 extern "C" void Kernel_Main(void *mbi_addr)
 {
+  cpu_features_init();
   basic_init(mbi_addr);
+  // the lapic timers of every cpu are calibrated against it
+  ktime_init();
   RSDT::GetInstance()->Init();
   kmalloc_init();
+  // the aps create their idle tasks as soon as they start
+  task_cache_init();
   pci_probe();
   // auto s = shared_ptr<UniqueTest>(new UniqueTest());
   SMP::GetInstance()->Init();
+#ifdef MOS_BENCHMARK
+  // the shootdown benchmark needs the aps online
+  benchmark_run();
+#endif
   task_init();
 }
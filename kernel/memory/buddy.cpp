@@ -0,0 +1,295 @@
+#include "buddy.h"
+#include <std/debug.h>
+#include <std/math.h>
+
+#define LEFT_LEAF(index) ((index)*2 + 1)
+#define RIGHT_LEAF(index) ((index)*2 + 2)
+#define PARENT(index) (((index) + 1) / 2 - 1)
+
+#define IS_POWER_OF_2(x) (!((x) & ((x)-1)))
+#define MAX(a, b) ((a) > (b) ? (a) : (b))
+
+// smallest order whose run holds page_count pages
+static uint32_t order_of(uint64_t page_count)
+{
+    uint32_t order = 0;
+    while ((1UL << order) < page_count)
+        ++order;
+    return order;
+}
+
+uint64_t BuddyTree::MetadataSize(uint64_t page_count)
+{
+    // node number is size * 2 - 1, we alloc size * 2
+    uint64_t rounded = IS_POWER_OF_2(page_count) ? page_count : next_pow_of_2(page_count);
+    return rounded * 2 * sizeof(uint32_t);
+}
+
+void BuddyTree::Init(uint8_t *metadata, Page *pages, uint64_t page_count, uint64_t reserved_count)
+{
+    this->nodes = (uint32_t *)metadata;
+    this->pages = pages;
+    this->page_count = page_count;
+    this->page_count_rounded_up = IS_POWER_OF_2(page_count) ? page_count : next_pow_of_2(page_count);
+
+    // build the buddy tree
+    auto node_size = this->page_count_rounded_up * 2;
+    for (uint64_t i = 0; i < 2 * this->page_count_rounded_up - 1; ++i)
+    {
+        if (IS_POWER_OF_2(i + 1))
+            node_size /= 2;
+        this->nodes[i] = node_size;
+    }
+
+    // pages past the end only exist because of the rounding
+    // cover them with the largest aligned runs so they're never handed out
+    uint64_t offset = page_count;
+    while (offset < this->page_count_rounded_up)
+    {
+        uint64_t size = offset & -offset;
+        while (offset + size > this->page_count_rounded_up)
+            size /= 2;
+        MarkUsed(this->page_count_rounded_up / size - 1 + offset / size);
+        offset += size;
+    }
+
+    for (uint64_t i = 0; i < reserved_count; ++i)
+        this->Allocate(1);
+}
+
+void BuddyTree::MarkUsed(uint64_t index)
+{
+    this->nodes[index] = 0;
+    while (index)
+    {
+        index = PARENT(index);
+        this->nodes[index] =
+            MAX(this->nodes[LEFT_LEAF(index)], this->nodes[RIGHT_LEAF(index)]);
+    }
+}
+
+int64_t BuddyTree::Allocate(uint64_t pages_count)
+{
+    assert(pages_count >= 1);
+
+    if (!IS_POWER_OF_2(pages_count))
+        pages_count = next_pow_of_2(pages_count);
+    uint64_t index = 0;
+    // if the first(largest) doesn't fit return error
+    if (this->nodes[index] < pages_count)
+        return -1;
+
+    auto node_size = this->page_count_rounded_up;
+    for (; node_size != pages_count; node_size /= 2)
+    {
+        if (this->nodes[LEFT_LEAF(index)] >= pages_count)
+            index = LEFT_LEAF(index);
+        else
+            index = RIGHT_LEAF(index);
+    }
+    auto offset = (index + 1) * node_size - this->page_count_rounded_up;
+
+    // 标记为已用
+    MarkUsed(index);
+    this->pages[offset].buddy_order = order_of(pages_count);
+    return offset;
+}
+
+bool BuddyTree::Reserve(uint64_t page_index)
+{
+    if (page_index >= this->page_count)
+        return true;
+    // make sure the branch is free
+    auto leaf = page_index + this->page_count_rounded_up - 1;
+    auto index = leaf;
+    do
+    {
+        if (this->nodes[index] == 0)
+            return false;
+        index = PARENT(index);
+    } while (index > 0);
+
+    MarkUsed(leaf);
+    return true;
+}
+
+uint64_t BuddyTree::Free(uint64_t offset)
+{
+    uint64_t node_size, index = 0;
+    uint64_t left_longest, right_longest;
+
+    assert(offset < this->page_count);
+
+    node_size = 1;
+    index = offset + this->page_count_rounded_up - 1;
+
+    for (; this->nodes[index]; index = PARENT(index))
+    {
+        node_size *= 2;
+        if (index == 0)
+            return 0;
+    }
+
+    this->nodes[index] = node_size;
+    auto freed = node_size;
+
+    while (index)
+    {
+        index = PARENT(index);
+        node_size *= 2;
+
+        left_longest = this->nodes[LEFT_LEAF(index)];
+        right_longest = this->nodes[RIGHT_LEAF(index)];
+
+        if (left_longest + right_longest == node_size)
+            this->nodes[index] = node_size;
+        else
+            this->nodes[index] = MAX(left_longest, right_longest);
+    }
+    return freed;
+}
+
+uint64_t BuddyFreeList::MetadataSize(uint64_t)
+{
+    // everything lives in Page
+    return 0;
+}
+
+void BuddyFreeList::Init(uint8_t *, Page *pages, uint64_t page_count, uint64_t reserved_count)
+{
+    this->pages = pages;
+    this->page_count = page_count;
+    this->free_mask = 0;
+    for (uint32_t order = 0; order < BUDDY_ORDER_NUM; ++order)
+        list_init(&this->free_lists[order]);
+
+    for (uint64_t i = 0; i < page_count; ++i)
+    {
+        pages[i].buddy_order = 0;
+        pages[i].buddy_free = 0;
+    }
+
+    // split the rest into the largest aligned runs
+    uint64_t index = reserved_count;
+    while (index < page_count)
+    {
+        uint32_t order = 0;
+        while (order + 1 < BUDDY_ORDER_NUM &&
+               (index & ((1UL << (order + 1)) - 1)) == 0 &&
+               index + (1UL << (order + 1)) <= page_count)
+            ++order;
+        Push(index, order);
+        index += 1UL << order;
+    }
+}
+
+void BuddyFreeList::Push(uint64_t page_index, uint32_t order)
+{
+    auto page = &this->pages[page_index];
+    page->buddy_order = order;
+    page->buddy_free = 1;
+    list_add_to_behind(&this->free_lists[order], &page->list);
+    this->free_mask |= 1U << order;
+}
+
+void BuddyFreeList::Remove(uint64_t page_index, uint32_t order)
+{
+    auto page = &this->pages[page_index];
+    page->buddy_free = 0;
+    list_del(&page->list);
+    if (list_is_empty(&this->free_lists[order]))
+        this->free_mask &= ~(1U << order);
+}
+
+int64_t BuddyFreeList::Allocate(uint64_t pages_count)
+{
+    assert(pages_count >= 1);
+
+    uint32_t order = order_of(pages_count);
+    if (order >= BUDDY_ORDER_NUM)
+        return -1;
+
+    // lowest order with a free run that is large enough
+    uint32_t mask = this->free_mask & ~((1U << order) - 1);
+    if (!mask)
+        return -1;
+    uint32_t current = __builtin_ctz(mask);
+
+    auto page = container_of(this->free_lists[current].next, Page, list);
+    uint64_t index = page - this->pages;
+    Remove(index, current);
+
+    // give the upper halves back until the run fits
+    while (current > order)
+    {
+        --current;
+        Push(index + (1UL << current), current);
+    }
+
+    page->buddy_order = order;
+    return index;
+}
+
+uint64_t BuddyFreeList::Free(uint64_t page_index)
+{
+    assert(page_index < this->page_count);
+
+    auto page = &this->pages[page_index];
+    if (page->buddy_free)
+        return 0;
+
+    uint32_t order = page->buddy_order;
+    uint64_t freed = 1UL << order;
+
+    // merge with the buddy as long as it is a free run of the same order
+    while (order + 1 < BUDDY_ORDER_NUM)
+    {
+        uint64_t buddy = page_index ^ (1UL << order);
+        if (buddy + (1UL << order) > this->page_count)
+            break;
+        auto buddy_page = &this->pages[buddy];
+        if (!buddy_page->buddy_free || buddy_page->buddy_order != order)
+            break;
+
+        Remove(buddy, order);
+        page_index &= ~(1UL << order);
+        ++order;
+    }
+
+    Push(page_index, order);
+    return freed;
+}
+
+bool BuddyFreeList::Reserve(uint64_t page_index)
+{
+    if (page_index >= this->page_count)
+        return true;
+
+    // find the free run holding the page
+    for (uint32_t order = 0; order < BUDDY_ORDER_NUM; ++order)
+    {
+        uint64_t head = page_index & ~((1UL << order) - 1);
+        auto page = &this->pages[head];
+        if (!page->buddy_free || page->buddy_order != order)
+            continue;
+
+        Remove(head, order);
+        // split around the page, keep the halves without it
+        while (order > 0)
+        {
+            --order;
+            uint64_t half = 1UL << order;
+            if (page_index < head + half)
+                Push(head + half, order);
+            else
+            {
+                Push(head, order);
+                head += half;
+            }
+        }
+        this->pages[page_index].buddy_order = 0;
+        return true;
+    }
+
+    return false;
+}
@@ -0,0 +1,63 @@
+#pragma once
+#include <std/stdint.h>
+#include <std/list.h>
+#include "physical_page.h"
+
+// buddy engines hand out power of two runs of page indices
+// the caller owns locking and the Page array
+
+// implicit binary tree rounded up to a power of two pages
+// each node holds the largest free run below it
+class BuddyTree
+{
+public:
+    // bytes of metadata the engine needs in front of the Page array
+    static uint64_t MetadataSize(uint64_t page_count);
+
+    void Init(uint8_t *metadata, Page *pages, uint64_t page_count, uint64_t reserved_count);
+    // returns the first page index, -1 if no run is large enough
+    int64_t Allocate(uint64_t page_count);
+    // returns number of pages given back, 0 if page_index isn't allocated
+    uint64_t Free(uint64_t page_index);
+    bool Reserve(uint64_t page_index);
+
+private:
+    void MarkUsed(uint64_t index);
+
+    uint32_t *nodes;
+    Page *pages;
+    uint64_t page_count;
+    uint64_t page_count_rounded_up;
+};
+
+// orders handled by BuddyFreeList, 2^31 pages is far beyond any zone
+#define BUDDY_ORDER_NUM 32
+
+// one free list per order linked through Page::list
+// allocation pops the lowest non-empty order found with a bit scan
+class BuddyFreeList
+{
+public:
+    static uint64_t MetadataSize(uint64_t page_count);
+
+    void Init(uint8_t *metadata, Page *pages, uint64_t page_count, uint64_t reserved_count);
+    int64_t Allocate(uint64_t page_count);
+    uint64_t Free(uint64_t page_index);
+    bool Reserve(uint64_t page_index);
+
+private:
+    void Push(uint64_t page_index, uint32_t order);
+    void Remove(uint64_t page_index, uint32_t order);
+
+    List free_lists[BUDDY_ORDER_NUM];
+    // bit n is set when free_lists[n] isn't empty
+    uint32_t free_mask;
+    Page *pages;
+    uint64_t page_count;
+};
+
+#ifdef MOS_BUDDY_TREE
+typedef BuddyTree BuddyEngine;
+#else
+typedef BuddyFreeList BuddyEngine;
+#endif
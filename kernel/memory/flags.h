@@ -35,4 +35,7 @@
 #define PG_K_Share_To_U	(1 << 8)
 
 //
-#define PG_Slab		(1 << 9)
\ No newline at end of file
+#define PG_Slab		(1 << 9)
+
+// allocation only, the pages come back zeroed
+#define PG_Zeroed	(1 << 10)
\ No newline at end of file
@@ -0,0 +1,147 @@
+#include "kmem_cache.h"
+#include "physical.h"
+#include <smp/cpu.h>
+#include <std/printk.h>
+#include <std/debug.h>
+#include <std/kstring.h>
+#include <std/spinlock.h>
+#include <std/lock_guard.h>
+#include <std/new.h>
+
+static kmem_cache *kmem_caches[KMEM_CACHE_MAX];
+static Spinlock kmem_caches_lock;
+
+static bool magazines_enabled;
+
+// magazines of the bsp, aps get theirs from kmem_cache_cpu_init
+static KmemMagazine BootMagazines[KMEM_CACHE_MAX];
+
+kmem_cache *kmem_cache_create(const char *name, uint64_t size, uint64_t align, slab_ctor_t ctor)
+{
+    if (align == 0)
+        align = KMEM_CACHE_LINE;
+
+    auto cache = new kmem_cache();
+    if (!cache)
+        return nullptr;
+
+    cache->slab = slab_create_aligned(size, align, ctor);
+    if (!cache->slab)
+    {
+        delete cache;
+        return nullptr;
+    }
+    uint64_t name_len = strlen(name);
+    if (name_len >= KMEM_CACHE_NAME_SIZE)
+        name_len = KMEM_CACHE_NAME_SIZE - 1;
+    memcpy(cache->name, name, name_len);
+
+    {
+        LockGuard<Spinlock> lg(kmem_caches_lock);
+        for (uint32_t id = 0; id < KMEM_CACHE_MAX; ++id)
+        {
+            if (!kmem_caches[id])
+            {
+                cache->id = id;
+                kmem_caches[id] = cache;
+                return cache;
+            }
+        }
+    }
+
+    printk("kmem_cache %s: out of cache slots\n", name);
+    slab_free(cache->slab);
+    delete cache;
+    return nullptr;
+}
+
+int kmem_cache_destroy(kmem_cache *cache)
+{
+    // hand every magazine back first
+    if (magazines_enabled)
+    {
+        auto &cpus = CPU::GetInstance()->GetAll();
+        for (uint64_t i = 0; i < cpus.size(); ++i)
+        {
+            if (!cpus[i].kmem_magazines)
+                continue;
+            auto magazine = &cpus[i].kmem_magazines[cache->id];
+            cache->slab->FreeBatch(magazine->objects, magazine->count);
+            magazine->count = 0;
+        }
+    }
+
+    if (slab_free(cache->slab) != 0)
+    {
+        printk("kmem_cache %s: objects still in use\n", cache->name);
+        return -1;
+    }
+
+    {
+        LockGuard<Spinlock> lg(kmem_caches_lock);
+        kmem_caches[cache->id] = nullptr;
+    }
+    delete cache;
+    return 0;
+}
+
+void *kmem_cache_alloc(kmem_cache *cache)
+{
+    if (!magazines_enabled)
+        return cache->slab->Alloc();
+
+    void *object = nullptr;
+    // the magazine is only touched by its own cpu, keep interrupts out
+    asm volatile("pushf");
+    asm volatile("cli");
+    auto magazine = &this_cpu->kmem_magazines[cache->id];
+    if (magazine->count == 0)
+        magazine->count = cache->slab->AllocBatch(magazine->objects, KMEM_MAGAZINE_SIZE / 2);
+    if (magazine->count > 0)
+        object = magazine->objects[--magazine->count];
+    asm volatile("popf");
+    return object;
+}
+
+void kmem_cache_free(kmem_cache *cache, void *object)
+{
+    if (!magazines_enabled)
+        return cache->slab->Free((uint8_t *)object);
+
+    asm volatile("pushf");
+    asm volatile("cli");
+    auto magazine = &this_cpu->kmem_magazines[cache->id];
+    if (magazine->count == KMEM_MAGAZINE_SIZE)
+    {
+        // keep the most recently freed half, it is still warm
+        cache->slab->FreeBatch(magazine->objects, KMEM_MAGAZINE_SIZE / 2);
+        memcpy(magazine->objects, &magazine->objects[KMEM_MAGAZINE_SIZE / 2], sizeof(void *) * (KMEM_MAGAZINE_SIZE / 2));
+        magazine->count -= KMEM_MAGAZINE_SIZE / 2;
+    }
+    magazine->objects[magazine->count++] = object;
+    asm volatile("popf");
+}
+
+void kmem_cache_cpu_init(cpu_struct *cpu)
+{
+    if (cpu->kmem_magazines)
+        return;
+
+    if (cpu == &CPU::GetInstance()->Get())
+    {
+        cpu->kmem_magazines = BootMagazines;
+        return;
+    }
+
+    auto size = PAGE_4K_ROUND_UP(sizeof(KmemMagazine) * KMEM_CACHE_MAX);
+    auto page = PhysicalMemory::GetInstance()->Allocate(size / PAGE_4K_SIZE, 0);
+    if (!page)
+        panic("!kmem_cache magazines page\n");
+    cpu->kmem_magazines = (KmemMagazine *)Phy_To_Virt(page->physical_address);
+    bzero(cpu->kmem_magazines, size);
+}
+
+void kmem_cache_enable_magazines()
+{
+    magazines_enabled = true;
+}
@@ -0,0 +1,40 @@
+#pragma once
+#include <std/stdint.h>
+#include "slab.h"
+
+// most caches a kernel can create, each owns a magazine slot on every cpu
+#define KMEM_CACHE_MAX 32
+#define KMEM_CACHE_NAME_SIZE 32
+// free objects a cpu keeps per cache
+#define KMEM_MAGAZINE_SIZE 16
+#define KMEM_CACHE_LINE 64
+
+struct cpu_struct;
+
+struct KmemMagazine
+{
+    uint32_t count;
+    void *objects[KMEM_MAGAZINE_SIZE];
+};
+
+// named object cache on top of a Slab
+// objects keep their constructed state across free and alloc
+struct kmem_cache
+{
+    char name[KMEM_CACHE_NAME_SIZE];
+    // magazine slot of this cache
+    uint32_t id;
+    Slab *slab;
+};
+
+// align 0 means cache line aligned, ctor may be nullptr
+kmem_cache *kmem_cache_create(const char *name, uint64_t size, uint64_t align, slab_ctor_t ctor);
+// no cpu may use the cache any more
+int kmem_cache_destroy(kmem_cache *cache);
+void *kmem_cache_alloc(kmem_cache *cache);
+void kmem_cache_free(kmem_cache *cache, void *object);
+
+// give cpu its magazines, they are used once kmem_cache_enable_magazines is called
+void kmem_cache_cpu_init(cpu_struct *cpu);
+// this_cpu must be valid on every cpu from now on
+void kmem_cache_enable_magazines();
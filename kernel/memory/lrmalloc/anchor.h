@@ -5,6 +5,9 @@
 struct Anchor
 {
     uint64_t state : 2;
-    uint64_t avail : 31;
-    uint64_t count : 31;
+    uint64_t avail : 20;
+    uint64_t count : 21;
+    // blocks below this index have been handed out at least once
+    // the rest of the superblock is untouched
+    uint64_t carved : 21;
 };
\ No newline at end of file
@@ -7,9 +7,7 @@ TCacheBin TCache[MAX_SZ_IDX];
 void TCacheBin::PushBlock(char *block)
 {
     // block has at least sizeof(char*)
-    // sub 8 bytes point to it's origin offset
-    block -= sizeof(uint64_t);
-    *(char**)(block + sizeof(uint64_t)) = _block;
+    *(char **)block = _block;
     _block = block;
     _blockNum++;
 }
@@ -32,11 +30,11 @@ char *TCacheBin::PopBlock()
     // get the first block
     char *ret = _block;
     // advance to the next block
-    _block = *(char **)(_block + sizeof(uint64_t));
+    _block = *(char **)_block;
     // decr counter
     _blockNum--;
     // return the first block
-    return ret + sizeof(uint64_t);
+    return ret;
 }
 
 void TCacheBin::PopList(char *block, uint32_t length)
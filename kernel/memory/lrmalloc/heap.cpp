@@ -1,4 +1,6 @@
 #include "heap.h"
+#include <std/lock_guard.h>
+#include <memory/zone.h>
 
 ProcHeap Heaps[MAX_SZ_IDX];
 
@@ -9,5 +11,54 @@ void lrmalloc_heap_init()
         ProcHeap &heap = Heaps[idx];
         heap.partialList.store(nullptr);
         heap.scIdx = idx;
+        heap.sbCacheNum = 0;
     }
+}
+
+Page *HeapPopSuperblock(ProcHeap *heap)
+{
+    auto node = PhysicalMemory::GetInstance()->LocalNode();
+    LockGuard lg(heap->sbCacheLock);
+    if (heap->sbCacheNum == 0)
+        return nullptr;
+
+    // newest superblock on the local node, else the newest one
+    uint32_t idx = heap->sbCacheNum - 1;
+    for (uint32_t i = heap->sbCacheNum; i > 0; --i)
+    {
+        if (heap->sbCache[i - 1]->zone->Node() == node)
+        {
+            idx = i - 1;
+            break;
+        }
+    }
+
+    auto page = heap->sbCache[idx];
+    for (; idx + 1 < heap->sbCacheNum; ++idx)
+        heap->sbCache[idx] = heap->sbCache[idx + 1];
+    --heap->sbCacheNum;
+    return page;
+}
+
+void HeapPushSuperblock(ProcHeap *heap, Page *page)
+{
+    Page *drain[SB_CACHE_HIGH];
+    uint32_t drainNum = 0;
+    {
+        LockGuard lg(heap->sbCacheLock);
+        if (heap->sbCacheNum == SB_CACHE_HIGH)
+        {
+            // keep the most recently freed ones, they are still warm
+            for (uint32_t idx = SB_CACHE_LOW; idx < SB_CACHE_HIGH; ++idx)
+                drain[drainNum++] = heap->sbCache[idx - SB_CACHE_LOW];
+            for (uint32_t idx = 0; idx < SB_CACHE_LOW; ++idx)
+                heap->sbCache[idx] = heap->sbCache[idx + drainNum];
+            heap->sbCacheNum = SB_CACHE_LOW;
+        }
+        heap->sbCache[heap->sbCacheNum++] = page;
+    }
+
+    // don't hold the cache lock across the zone lock
+    for (uint32_t idx = 0; idx < drainNum; ++idx)
+        PhysicalMemory::GetInstance()->Free(drain[idx]);
 }
\ No newline at end of file
@@ -3,6 +3,12 @@
 #include "size_class.h"
 #include <std/atomic.h>
 #include "descriptor.h"
+#include <std/spinlock.h>
+
+// empty superblocks a size class keeps before returning them to the buddy system
+#define SB_CACHE_HIGH 2
+// superblocks left in the cache once it has been drained
+#define SB_CACHE_LOW 1
 
 struct SizeClassData;
 
@@ -13,6 +19,10 @@ public:
     std::atomic<DescriptorNode> partialList;
     // size class index
     size_t scIdx;
+    // recycled empty superblocks, saves the buddy lock on churn
+    Spinlock sbCacheLock;
+    Page *sbCache[SB_CACHE_HIGH];
+    uint32_t sbCacheNum;
 
 public:
     size_t GetScIdx() const { return scIdx; }
@@ -25,3 +35,7 @@ public:
 extern ProcHeap Heaps[MAX_SZ_IDX];
 
 void lrmalloc_heap_init();
+// take a cached empty superblock, nullptr if there is none
+Page *HeapPopSuperblock(ProcHeap *heap);
+// cache an empty superblock, draining to SB_CACHE_LOW when full
+void HeapPushSuperblock(ProcHeap *heap, Page *page);
@@ -3,6 +3,7 @@
 #include "heap.h"
 #include "../heap.h"
 #include <smp/cpu.h>
+#include <std/new.h>
 
 // set true when smp init completed
 static bool full_init;
@@ -17,10 +18,51 @@ void lrmalloc_init()
     CPU::GetInstance()->Get().mcache = TCache;
 }
 
-struct lrmalloc_meta
+void lrmalloc_cpu_init(cpu_struct *cpu)
 {
-    Descriptor *desc;
-};
+    // bsp already owns the static TCache
+    if (cpu->mcache)
+        return;
+
+    // each ap gets private bins so the fast path stays lock-free
+    auto bins_size = PAGE_CEILING(sizeof(TCacheBin) * MAX_SZ_IDX);
+    auto page = PhysicalMemory::GetInstance()->Allocate(bins_size / PAGE_4K_SIZE, 0);
+    // the ap can't allocate without its bins
+    if (!page)
+        panic("!lrmalloc bins page\n");
+    auto bins = (TCacheBin *)Phy_To_Virt(page->physical_address);
+    for (size_t idx = 0; idx < MAX_SZ_IDX; ++idx)
+    {
+        new (&bins[idx]) TCacheBin();
+    }
+    cpu->mcache = bins;
+}
+
+// allocations above the largest size class are whole page runs
+// taken straight from the buddy system, their first Page has no desc
+static void *lrmalloc_large(size_t size)
+{
+    auto page_count = PAGE_CEILING(size) / PAGE;
+    auto page = PhysicalMemory::GetInstance()->Allocate(page_count, 0);
+    if (!page)
+        return nullptr;
+
+    // the page may have been part of a superblock before
+    page->desc = nullptr;
+    return Phy_To_Virt(page->physical_address);
+}
+
+static void lrfree_large(Page *page)
+{
+    // the buddy system knows the run length, return it as a whole
+    PhysicalMemory::GetInstance()->Free(page);
+}
+
+// descriptor of the superblock a small block lives in
+static Descriptor *BlockDesc(void *block)
+{
+    return PhysicalMemory::GetInstance()->PageOf((uint64_t)Virt_To_Phy(block))->desc;
+}
 
 void DescRetire(Descriptor *desc)
 {
@@ -52,6 +94,51 @@ Descriptor *HeapPopPartial(ProcHeap *heap)
     return oldHead.GetDesc();
 }
 
+void HeapPushPartial(Descriptor *desc)
+{
+    ProcHeap *heap = desc->heap;
+    auto &list = heap->partialList;
+
+    DescriptorNode oldHead = list.load();
+    DescriptorNode newHead;
+    do
+    {
+        newHead.Set(desc, oldHead.GetCounter() + 1);
+        // ASSERT(oldHead.GetDesc() != newHead.GetDesc());
+        newHead.GetDesc()->nextPartial.store(oldHead);
+    } while (!list.compare_exchange(oldHead, newHead));
+}
+
+// bytes of a superblock threaded into a free list at a time
+#define LAZY_CARVE_SIZE (PAGE * 4)
+
+// number of untouched blocks to carve next
+static uint32_t CarveNum(Descriptor *desc, uint32_t carved)
+{
+    uint32_t num = LAZY_CARVE_SIZE / desc->blockSize;
+    if (num == 0)
+        num = 1;
+    if (num > desc->maxcount - carved)
+        num = desc->maxcount - carved;
+    return num;
+}
+
+// thread blocks [start, start + num) into a list
+// this is the first time these blocks are written
+static char *CarveBlocks(Descriptor *desc, uint32_t start, uint32_t num)
+{
+    uint32_t const blockSize = desc->blockSize;
+    char *first = desc->superblock + start * blockSize;
+    char *block = first;
+    for (uint32_t idx = 0; idx < num; ++idx)
+    {
+        char *next = idx + 1 < num ? block + blockSize : nullptr;
+        *(char **)block = next;
+        block = next;
+    }
+    return first;
+}
+
 void MallocFromPartial(size_t scIdx, TCacheBin *cache, size_t &blockNum)
 {
     ProcHeap *heap = &Heaps[scIdx];
@@ -66,6 +153,7 @@ void MallocFromPartial(size_t scIdx, TCacheBin *cache, size_t &blockNum)
     uint32_t maxcount = desc->maxcount;
     uint32_t blockSize = desc->blockSize;
     char *superblock = desc->superblock;
+    uint32_t carveNum;
 
     // we have "ownership" of block, but anchor can still change
     // due to free()
@@ -85,11 +173,16 @@ void MallocFromPartial(size_t scIdx, TCacheBin *cache, size_t &blockNum)
         // obviously can't be SB_ACTIVE
         // ASSERT(oldAnchor.state == SB_PARTIAL);
 
+        // prefer freed blocks, only carve when the list is empty
+        carveNum = oldAnchor.count == 0 ? CarveNum(desc, oldAnchor.carved) : 0;
+
         newAnchor = oldAnchor;
         newAnchor.count = 0;
         // avail value doesn't actually matter
         newAnchor.avail = maxcount;
-        newAnchor.state = SB_FULL;
+        newAnchor.carved += carveNum;
+        // superblock stays in the partial list while untouched blocks remain
+        newAnchor.state = newAnchor.carved < maxcount ? SB_PARTIAL : SB_FULL;
     } while (!desc->anchor.compare_exchange(
         oldAnchor, newAnchor));
 
@@ -100,9 +193,17 @@ void MallocFromPartial(size_t scIdx, TCacheBin *cache, size_t &blockNum)
     //  through FlushCache, which we can then use
     uint32_t blocksTaken = oldAnchor.count;
     uint32_t avail = oldAnchor.avail;
-
-    // ASSERT(avail < maxcount);
-    char *block = superblock + avail * blockSize;
+    char *block;
+    if (carveNum > 0)
+    {
+        block = CarveBlocks(desc, oldAnchor.carved, carveNum);
+        blocksTaken = carveNum;
+    }
+    else
+    {
+        // ASSERT(avail < maxcount);
+        block = superblock + avail * blockSize;
+    }
 
     // cache must be empty at this point
     // and the blocks are already organized as a list
@@ -110,6 +211,10 @@ void MallocFromPartial(size_t scIdx, TCacheBin *cache, size_t &blockNum)
     // ASSERT(cache->GetBlockNum() == 0);
     cache->PushList(block, blocksTaken);
 
+    // we popped it, so we put it back
+    if (newAnchor.state == SB_PARTIAL)
+        HeapPushPartial(desc);
+
     blockNum += blocksTaken;
 }
 
@@ -120,44 +225,33 @@ void MallocFromNewSB(size_t scIdx, TCacheBin *cache, size_t &blockNum)
 
     Descriptor *desc = DescAlloc();
 
-    uint32_t const blockSize = sc->blockSize;
     uint32_t const maxcount = sc->GetBlockNum();
 
     desc->heap = heap;
-    desc->blockSize = blockSize;
+    desc->blockSize = sc->blockSize;
     desc->maxcount = maxcount;
     // superblock is 4k aligned
     // thus two block in the same page owned by the same superblock
-    auto page = PhysicalMemory::GetInstance()->Allocate(sc->sbSize / PAGE_4K_SIZE, 0);
+    // recycled superblocks skip the buddy system
+    auto page = HeapPopSuperblock(heap);
+    if (!page)
+        page = PhysicalMemory::GetInstance()->Allocate(sc->sbSize / PAGE_4K_SIZE, 0);
     desc->superblock_page = page;
     desc->superblock = (char *)Phy_To_Virt(page->physical_address);
+    // blocks carry no header, lrfree finds desc through the page
+    for (uint64_t idx = 0; idx < sc->sbSize / PAGE_4K_SIZE; ++idx)
+        page[idx].desc = desc;
 
-    // prepare block list
-    char *superblock = desc->superblock;
-    for (uint32_t idx = 0; idx < maxcount - 1; ++idx)
-    {
-        char *block = superblock + idx * blockSize;
-        char *next = superblock + (idx + 1) * blockSize;
-        *(char **)(block + sizeof(uint64_t)) = next;
-        auto meta = (lrmalloc_meta *)block;
-        meta->desc = desc;
-    }
-
-    // for the last block
-    auto last_idx = maxcount - 1;
-    char *last_block = superblock + last_idx * blockSize;
-    *(char **)(last_block + sizeof(uint64_t)) = nullptr;
-    ((lrmalloc_meta *)last_block)->desc = desc;
-
-    // push blocks to cache
-    char *block = superblock; // first block
-    auto meta = (lrmalloc_meta *)block;
-    cache->PushList(block, maxcount);
+    // only the head of the superblock is carved now,
+    //  the rest is carved on demand by MallocFromPartial
+    uint32_t carveNum = CarveNum(desc, 0);
+    cache->PushList(CarveBlocks(desc, 0, carveNum), carveNum);
 
     Anchor anchor;
     anchor.avail = maxcount;
     anchor.count = 0;
-    anchor.state = SB_FULL;
+    anchor.carved = carveNum;
+    anchor.state = carveNum < maxcount ? SB_PARTIAL : SB_FULL;
 
     desc->anchor.store(anchor);
 
@@ -166,7 +260,10 @@ void MallocFromNewSB(size_t scIdx, TCacheBin *cache, size_t &blockNum)
     // or leaving superblock as available in a partial list
 
     // if state changes to SB_PARTIAL, desc must be added to partial list
-    blockNum += maxcount;
+    if (anchor.state == SB_PARTIAL)
+        HeapPushPartial(desc);
+
+    blockNum += carveNum;
 }
 
 uint32_t ComputeIdx(char *superblock, char *block, size_t scIdx)
@@ -200,21 +297,6 @@ uint32_t ComputeIdx(char *superblock, char *block, size_t scIdx)
     return idx;
 }
 
-void HeapPushPartial(Descriptor *desc)
-{
-    ProcHeap *heap = desc->heap;
-    auto &list = heap->partialList;
-
-    DescriptorNode oldHead = list.load();
-    DescriptorNode newHead;
-    do
-    {
-        newHead.Set(desc, oldHead.GetCounter() + 1);
-        // ASSERT(oldHead.GetDesc() != newHead.GetDesc());
-        newHead.GetDesc()->nextPartial.store(oldHead);
-    } while (!list.compare_exchange(oldHead, newHead));
-}
-
 void FillCache(size_t scIdx, TCacheBin *cache)
 {
     // at most cache will be filled with number of blocks equal to superblock
@@ -229,96 +311,144 @@ void FillCache(size_t scIdx, TCacheBin *cache)
     (void)sc;
 }
 
-// the blocks in the cache may comes from different superblock
-void FlushCache(size_t scIdx, TCacheBin *cache)
+// number of superblocks FlushCache keeps open while grouping blocks
+#define FLUSH_GROUP_NUM 16
+
+// blocks of one superblock collected by FlushCache
+struct FlushGroup
+{
+    Descriptor *desc;
+    char *head;
+    char *tail;
+    uint32_t blockCount;
+};
+
+// return a list of blocks owned by a single descriptor with one CAS
+static void FlushGroupToDesc(size_t scIdx, FlushGroup const &group)
 {
-    ProcHeap *heap = &Heaps[scIdx];
     SizeClassData *sc = &SizeClasses[scIdx];
-    uint32_t const sbSize = sc->sbSize;
     uint32_t const blockSize = sc->blockSize;
-    // after CAS, desc might become empty and
-    //  concurrently reused, so store maxcount
-    uint32_t const maxcount = sc->GetBlockNum();
-    (void)maxcount; // suppress unused warning
-    // @todo: optimize
-    // in the normal case, we should be able to return several
-    //  blocks with a single CAS
-    while (cache->GetBlockNum() > 0)
+    Descriptor *desc = group.desc;
+    char *superblock = desc->superblock;
+
+    // add list to desc, update anchor
+    uint32_t idx = ComputeIdx(superblock, group.head, scIdx);
+
+    Anchor oldAnchor = desc->anchor.load();
+    Anchor newAnchor;
+    do
     {
-        char *head = cache->PeekBlock();
-        char *tail = head;
-        auto meta = (lrmalloc_meta *)head;
-        Descriptor *desc = meta->desc;
-        char *superblock = desc->superblock;
-
-        // cache is a linked list of blocks
-        // superblock free list is also a linked list of blocks
-        // can optimize transfers of blocks between these 2 entities
-        // by exploiting existing structure
-        uint32_t blockCount = 1;
-        // check if next cache blocks are in the same superblock
-        // same superblock, same descriptor
-        while (cache->GetBlockNum() > blockCount)
-        {
-            char *ptr = *(char **)(tail + sizeof(uint64_t));
-            if (ptr < superblock || ptr >= superblock + sbSize)
-                break; // ptr not in superblock
+        // update anchor.avail
+        char *next = (char *)(superblock + oldAnchor.avail * blockSize);
+        *(char **)group.tail = next;
 
-            // ptr in superblock, add to "list"
-            ++blockCount;
-            tail = ptr;
+        newAnchor = oldAnchor;
+        newAnchor.avail = idx;
+        // state updates
+        // don't set SB_PARTIAL if state == SB_ACTIVE
+        if (oldAnchor.state == SB_FULL)
+            newAnchor.state = SB_PARTIAL;
+        // this can't happen with SB_ACTIVE
+        // because of reserved blocks
+        // untouched blocks never left the superblock
+        if (oldAnchor.count + group.blockCount == oldAnchor.carved)
+        {
+            newAnchor.count = oldAnchor.carved;
+            newAnchor.state = SB_EMPTY; // can free superblock
         }
+        else
+            newAnchor.count += group.blockCount;
+    } while (!desc->anchor.compare_exchange(oldAnchor, newAnchor));
+
+    // after last CAS, can't reliably read any desc fields
+    // as desc might have become empty and been concurrently reused
+    // ASSERT(oldAnchor.avail < maxcount || oldAnchor.state == SB_FULL);
+    // ASSERT(newAnchor.avail < maxcount);
+    // ASSERT(newAnchor.count < maxcount);
+
+    // CAS success, can free block
+    if (newAnchor.state == SB_EMPTY)
+    {
+        // keep superblock around for the next MallocFromNewSB
+        HeapPushSuperblock(&Heaps[scIdx], desc->superblock_page);
+        // a full desc is in no partial list, nobody else will retire it
+        if (oldAnchor.state == SB_FULL)
+            DescRetire(desc);
+    }
+    else if (oldAnchor.state == SB_FULL)
+        HeapPushPartial(desc);
+}
 
-        cache->PopList(*(char **)(tail + sizeof(uint64_t)), blockCount);
-
-        // add list to desc, update anchor
-        uint32_t idx = ComputeIdx(superblock, head, scIdx);
+// the blocks in the cache may comes from different superblock
+// bucket them by descriptor first, so interleaved frees still
+//  cost one anchor CAS per superblock instead of one per run
+void FlushCache(size_t scIdx, TCacheBin *cache)
+{
+    FlushGroup groups[FLUSH_GROUP_NUM];
+    uint32_t groupNum = 0;
+    // consecutive blocks usually share a superblock, try it first
+    uint32_t last = 0;
+
+    uint32_t const blockNum = cache->GetBlockNum();
+    char *block = cache->PeekBlock();
+    for (uint32_t i = 0; i < blockNum; ++i)
+    {
+        char *next = *(char **)block;
+        Descriptor *desc = BlockDesc(block);
 
-        Anchor oldAnchor = desc->anchor.load();
-        Anchor newAnchor;
-        do
+        uint32_t g = last;
+        if (g >= groupNum || groups[g].desc != desc)
         {
-            // update anchor.avail
-            char *next = (char *)(superblock + oldAnchor.avail * blockSize);
-            *(char **)(tail + sizeof(uint64_t)) = next;
-
-            newAnchor = oldAnchor;
-            newAnchor.avail = idx;
-            // state updates
-            // don't set SB_PARTIAL if state == SB_ACTIVE
-            if (oldAnchor.state == SB_FULL)
-                newAnchor.state = SB_PARTIAL;
-            // this can't happen with SB_ACTIVE
-            // because of reserved blocks
-            if (oldAnchor.count + blockCount == desc->maxcount)
+            for (g = 0; g < groupNum; ++g)
             {
-                newAnchor.count = desc->maxcount;
-                newAnchor.state = SB_EMPTY; // can free superblock
+                if (groups[g].desc == desc)
+                    break;
             }
-            else
-                newAnchor.count += blockCount;
-        } while (!desc->anchor.compare_exchange(oldAnchor, newAnchor));
-
-        // after last CAS, can't reliably read any desc fields
-        // as desc might have become empty and been concurrently reused
-        // ASSERT(oldAnchor.avail < maxcount || oldAnchor.state == SB_FULL);
-        // ASSERT(newAnchor.avail < maxcount);
-        // ASSERT(newAnchor.count < maxcount);
+        }
 
-        // CAS success, can free block
-        if (newAnchor.state == SB_EMPTY)
+        if (g == groupNum)
         {
-            // free superblock
-            PhysicalMemory::GetInstance()->Free(desc->superblock_page);
+            if (groupNum < FLUSH_GROUP_NUM)
+                ++groupNum;
+            else
+            {
+                // out of slots, publish the biggest group to make room
+                g = 0;
+                for (uint32_t j = 1; j < FLUSH_GROUP_NUM; ++j)
+                {
+                    if (groups[j].blockCount > groups[g].blockCount)
+                        g = j;
+                }
+                FlushGroupToDesc(scIdx, groups[g]);
+            }
+            groups[g].desc = desc;
+            groups[g].head = nullptr;
+            groups[g].tail = block;
+            groups[g].blockCount = 0;
         }
-        else if (oldAnchor.state == SB_FULL)
-            HeapPushPartial(desc);
+
+        // push block in front of its group
+        *(char **)block = groups[g].head;
+        groups[g].head = block;
+        ++groups[g].blockCount;
+        last = g;
+
+        block = next;
     }
+
+    cache->PopList(nullptr, blockNum);
+
+    for (uint32_t g = 0; g < groupNum; ++g)
+        FlushGroupToDesc(scIdx, groups[g]);
 }
 void *lrmalloc(size_t size)
 {
-    // size class calculation
-    size_t scIdx = get_size_class(size + sizeof(lrmalloc_meta));
+    // size class calculation, get_size_class takes a uint32_t
+    size_t scIdx = size <= MAX_SZ ? get_size_class(size) : 0;
+    // no size class covers the request
+    if (scIdx == 0)
+        return lrmalloc_large(size);
+
     TCacheBin *cache = &this_cpu->mcache[scIdx];
     // fill cache if needed
     if (cache->GetBlockNum() == 0)
@@ -334,9 +464,13 @@ void lrfree(const void *ptr)
         panic("freeing nullptr");
     }
 
-    auto meta = (lrmalloc_meta *)((int8_t*)ptr - sizeof(uint64_t));
-    auto scIdx = meta->desc->heap->GetScIdx();
-    auto sc = meta->desc->heap->GetSizeClass();
+    auto page = PhysicalMemory::GetInstance()->PageOf((uint64_t)Virt_To_Phy(ptr));
+    auto desc = page->desc;
+    if (!desc)
+        return lrfree_large(page);
+
+    auto scIdx = desc->heap->GetScIdx();
+    auto sc = desc->heap->GetSizeClass();
     auto cache = &this_cpu->mcache[scIdx];
     // flush cache if need
     if (cache->GetBlockNum() >= sc->cacheBlockNum)
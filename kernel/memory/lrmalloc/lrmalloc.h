@@ -17,7 +17,11 @@ enum SuperblockState
     SB_EMPTY = 2,
 };
 
+struct cpu_struct;
+
 void *lrmalloc(size_t size);
 void lrfree(const void *ptr);
 
-void lrmalloc_init();
\ No newline at end of file
+void lrmalloc_init();
+// allocate the thread cache bins of an ap, must be called before the ap uses kmalloc
+void lrmalloc_cpu_init(cpu_struct *cpu);
\ No newline at end of file
@@ -18,9 +18,6 @@
     SIZE_CLASS_bin_yes((1U << lg_grp) + (ndelta << lg_delta), pgs)
 
 #define LG_MAX_SIZE_IDX 6
-// last size covered by a size class
-// allocations with size > MAX_SZ are not covered by a size class
-#define MAX_SZ ((1 << 13) + (1 << 11) * 3)
 
 SizeClassData SizeClasses[MAX_SZ_IDX] = {
     {0, 0},
@@ -76,14 +73,11 @@ uint32_t get_size_class(uint32_t size)
     if (size > MAX_SZ)
         return 0;
 
-    for (size_t scIdx = 1; scIdx < MAX_SZ_IDX - 1; ++scIdx)
+    // smallest class that holds size
+    for (size_t scIdx = 1; scIdx < MAX_SZ_IDX; ++scIdx)
     {
-        auto &sc = SizeClasses[scIdx];
-        auto &sc_next = SizeClasses[scIdx + 1];
-        if (size >= sc.blockSize && size < sc_next.blockSize)
-        {
-            return scIdx + 1;
-        }
+        if (size <= SizeClasses[scIdx].blockSize)
+            return scIdx;
     }
 
     return 0;
@@ -14,6 +14,9 @@
 // number of size classes
 // idx 0 reserved for large size classes
 #define MAX_SZ_IDX 40
+// last size covered by a size class
+// allocations with size > MAX_SZ are not covered by a size class
+#define MAX_SZ ((1 << 13) + (1 << 11) * 3)
 
 struct SizeClassData
 {
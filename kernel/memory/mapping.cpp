@@ -2,74 +2,141 @@
 #include "virtual_page.h"
 #include "physical.h"
 #include "flags.h"
+#include "tlb.h"
+#include <std/cpu_features.h>
 
-// kernel reserve 0x600000 ~ 0x800000 2M virtual address for storing 512 PTE
-static uint8_t*kernel_pte_reserved = (uint8_t*)0x600000 + PAGE_OFFSET;
+extern "C" char pml4;
 
-static uint8_t*pte_alloc()
-{
-    printk("pte_alloc\n");
-    auto res = kernel_pte_reserved;
-    kernel_pte_reserved = kernel_pte_reserved + PAGE_4K_SIZE;
-    return res;
-}
+// the direct map shares one pdpe page, every pml4 copies its entry
+static __attribute__((aligned(0x1000))) Page_PDPE direct_map_pdpe[512];
+// 2MB pages of the first PHYSICAL_MAPPED_END when the cpu has no 1GB pages
+static __attribute__((aligned(0x1000))) Page_PDE direct_map_pde[PHYSICAL_MAPPED_END >> PAGE_1G_SHIFT][512];
+static bool direct_map_1g;
 
-struct SwapPTE
+// map [start, end) of the 1GB at gb_base with 2MB pages
+static void direct_map_fill_pde(Page_PDE *pde, uint64_t gb_base, uint64_t start, uint64_t end)
 {
-    uint64_t paddr;
-    uint64_t vaddr;
-};
-
-static SwapPTE swap_pte;
+    auto first = start > gb_base ? (start - gb_base) >> PAGE_2M_SHIFT : 0;
+    auto last = end < gb_base + PAGE_1G_SIZE ? PAGE_2M_ALIGN(end - gb_base) >> PAGE_2M_SHIFT : 512;
+    for (auto i = first; i < last; ++i)
+    {
+        if (pde[i].P)
+            continue;
+        *(uint64_t *)&pde[i] = (gb_base + (i << PAGE_2M_SHIFT)) | PAGE_GLOBAL;
+        pde[i].SIZE = 1;
+        pde[i].R_W = 1;
+        pde[i].P = 1;
+    }
+}
 
 void vmap_init()
 {
-    swap_pte = {(uint64_t)Virt_To_Phy(kernel_pte_reserved), (uint64_t)kernel_pte_reserved};
-}
+    direct_map_1g = cpu_has(CPU_FEATURE_PAGE1GB);
+    for (uint64_t gb = 0; gb < (PHYSICAL_MAPPED_END >> PAGE_1G_SHIFT); ++gb)
+    {
+        auto &pdpe = direct_map_pdpe[gb];
+        if (direct_map_1g)
+        {
+            *(uint64_t *)&pdpe = (gb << PAGE_1G_SHIFT) | PAGE_GLOBAL;
+            pdpe.SIZE = 1;
+        }
+        else
+        {
+            direct_map_fill_pde(direct_map_pde[gb], gb << PAGE_1G_SHIFT, 0, PHYSICAL_MAPPED_END);
+            pdpe.NEXT = (uint64_t)Virt_To_Phy(direct_map_pde[gb]) >> PAGE_4K_SHIFT;
+        }
+        pdpe.R_W = 1;
+        pdpe.P = 1;
+    }
 
-extern "C" char pde;
+    // the boot tables identity map the low 2MB, pml4 is reachable as is
+    auto kernel_pml4 = (Page_PML4 *)&pml4;
+    kernel_pml4[DIRECT_MAP_PML4_INDEX].PDPE = (uint64_t)Virt_To_Phy(direct_map_pdpe) >> PAGE_4K_SHIFT;
+    kernel_pml4[DIRECT_MAP_PML4_INDEX].R_W = 1;
+    kernel_pml4[DIRECT_MAP_PML4_INDEX].P = 1;
+    tlb_flush_all();
+}
 
-int vmap_frame_kernel(uint8_t*vaddr, uint8_t*paddr)
+int direct_map_range(uint64_t start, uint64_t end)
 {
-    printk("mapping %p -> %p\n", vaddr, paddr);
-    auto ppde = &pde;
-    auto pml4_offset = ((uint64_t)vaddr & 0xff8000000000) >> 39;
-    auto pdpe_offset = ((uint64_t)vaddr & 0x7fc0000000) >> 30;
-    auto pde_offset = ((uint64_t)vaddr & 0x3fe00000) >> 21;
-    auto pte_offset = ((uint64_t)vaddr & 0x1ff000) >> 12;
-
-    Page_PDE *pde = (Page_PDE *)Phy_To_Virt(ppde);
+    if (end > DIRECT_MAP_SIZE)
+        return -1;
 
-    Page_PTE *pte = (Page_PTE *)Phy_To_Virt(pde[pde_offset].NEXT << PAGE_4K_SHIFT);
-    bool swap_used = false;
-    if ((uint64_t)pte == PAGE_OFFSET)
+    for (auto gb_base = start & ~(PAGE_1G_SIZE - 1); gb_base < end; gb_base += PAGE_1G_SIZE)
     {
-        pde[pde_offset].NEXT = swap_pte.paddr >> PAGE_4K_SHIFT;
-        *(uint64_t *)&pde[pde_offset] |= 0x3;
-        pte = (Page_PTE *)swap_pte.vaddr;
-        swap_used = true;
+        auto &pdpe = direct_map_pdpe[gb_base >> PAGE_1G_SHIFT];
+        if (direct_map_1g)
+        {
+            if (pdpe.P)
+                continue;
+            *(uint64_t *)&pdpe = gb_base | PAGE_GLOBAL;
+            pdpe.SIZE = 1;
+            pdpe.R_W = 1;
+            pdpe.P = 1;
+            continue;
+        }
+
+        if (!pdpe.P)
+        {
+            auto page = PhysicalMemory::GetInstance()->Allocate(1, PG_PTable_Maped | PG_Kernel | PG_Zeroed);
+            if (!page)
+                return -1;
+            pdpe.NEXT = (uint64_t)page->physical_address >> PAGE_4K_SHIFT;
+            pdpe.R_W = 1;
+            pdpe.P = 1;
+        }
+        direct_map_fill_pde((Page_PDE *)Phy_To_Virt(pdpe.NEXT << PAGE_4K_SHIFT), gb_base, start, end);
     }
 
-    // if (pte[pte_offset].P == 1)
-    // {
-    //     return -1;
-    // }
+    // only new entries were written, nothing stale can be cached
+    return 0;
+}
 
-    if (swap_used)
+// next level table of entry, allocated when missing, nullptr if entry maps a large page
+template <typename Entry>
+static uint8_t *kernel_table_next(Entry &entry)
+{
+    if (!entry.P)
     {
-        pte[pte_offset].PPBA = ((uint64_t)paddr) >> PAGE_4K_SHIFT;
-        *(uint64_t *)&pte[pte_offset] |= 0x3;
-
-        swap_pte.vaddr = (uint64_t)pte_alloc();
-        swap_pte.paddr = (uint64_t)Virt_To_Phy(swap_pte.vaddr);
+        auto page = PhysicalMemory::GetInstance()->Allocate(1, PG_PTable_Maped | PG_Kernel | PG_Zeroed);
+        if (!page)
+            return nullptr;
+        *(uint64_t *)&entry = (uint64_t)page->physical_address | 0x3;
     }
-    else
+    else if (*(uint64_t *)&entry & (1 << 7))
     {
-        pte[pte_offset].PPBA = ((uint64_t)paddr) >> PAGE_4K_SHIFT;
-        *(uint64_t *)&pte[pte_offset] |= 0x3;
+        return nullptr;
     }
+    return Phy_To_Virt(*(uint64_t *)&entry & 0xffffffffff000UL);
+}
+
+int vmap_frame_kernel(uint8_t *vaddr, uint8_t *paddr)
+{
+    // direct map addresses get a large page instead of a pte
+    if (vaddr == Phy_To_Virt(paddr))
+        return direct_map_range((uint64_t)paddr, (uint64_t)paddr + PAGE_4K_SIZE);
+
+    auto pml4_offset = ((uint64_t)vaddr >> 39) & 0x1ff;
+    auto pdpe_offset = ((uint64_t)vaddr >> 30) & 0x1ff;
+    auto pde_offset = ((uint64_t)vaddr >> 21) & 0x1ff;
+    auto pte_offset = ((uint64_t)vaddr >> 12) & 0x1ff;
+
+    auto kernel_pml4 = (Page_PML4 *)Phy_To_Virt(&pml4);
+    auto pdpe = (Page_PDPE *)kernel_table_next(kernel_pml4[pml4_offset]);
+    if (!pdpe)
+        return -1;
+    auto pde = (Page_PDE *)kernel_table_next(pdpe[pdpe_offset]);
+    if (!pde)
+        return -1;
+    auto pte = (Page_PTE *)kernel_table_next(pde[pde_offset]);
+    if (!pte)
+        return -1;
 
-    flush_tlb();
+    // kernel mappings are the same in every address space
+    *(uint64_t *)&pte[pte_offset] = (uint64_t)paddr | PAGE_GLOBAL | 0x3;
+
+    // one entry changed, no need to drop the whole tlb
+    tlb_flush_page(vaddr);
     return 0;
 }
 
@@ -81,48 +148,10 @@ int vmap_frame_kernel(uint64_t vaddr, uint64_t paddr)
 
 int vmap_frame_kernel(uint8_t*vaddr)
 {
-
-    auto ppde = &pde;
-    auto pde_offset = ((uint64_t)vaddr & 0x3fe00000) >> 21;
-    auto pte_offset = ((uint64_t)vaddr & 0x1ff000) >> 12;
-
-    Page_PDE *pde = (Page_PDE *)Phy_To_Virt(ppde);
-
-    Page_PTE *pte = (Page_PTE *)Phy_To_Virt(pde[pde_offset].NEXT << PAGE_4K_SHIFT);
-    bool swap_used = false;
-    if ((uint64_t)pte == PAGE_OFFSET)
-    {
-        pde[pde_offset].NEXT = swap_pte.paddr >> PAGE_4K_SHIFT;
-        *(uint64_t *)&pde[pde_offset] |= 0x3;
-        pte = (Page_PTE *)swap_pte.vaddr;
-        swap_used = true;
-    }
-
-    if (pte[pte_offset].P == 1)
-    {
+    auto page = PhysicalMemory::GetInstance()->Allocate(1, 0);
+    if (!page)
         return -1;
-    }
-
-    if (swap_used)
-    {
-
-        auto page = PhysicalMemory::GetInstance()->Allocate(1, 0);
-        pte[pte_offset].PPBA = ((uint64_t)page->physical_address) >> PAGE_4K_SHIFT;
-        *(uint64_t *)&pte[pte_offset] |= 0x3;
-
-        swap_pte.vaddr = (uint64_t)pte_alloc();
-        swap_pte.paddr = (uint64_t)Virt_To_Phy(swap_pte.vaddr);
-
-        flush_tlb();
-    }
-    else
-    {
-        auto page = PhysicalMemory::GetInstance()->Allocate(1, 0);
-        pte[pte_offset].PPBA = ((uint64_t)page->physical_address) >> PAGE_4K_SHIFT;
-        *(uint64_t *)&pte[pte_offset] |= 0x3;
-    }
-
-    return 0;
+    return vmap_frame_kernel(vaddr, page->physical_address);
 }
 
 int vmap_frame(task_struct *task, uint64_t vstart, uint64_t attributes)
@@ -141,18 +170,16 @@ int vmap_frame(task_struct *task, uint64_t vstart, uint64_t attributes)
 
     if (pml4_entry == nullptr)
     {
-        auto slot = pm_instance->Allocate(1, PG_PTable_Maped | PG_Active);
+        auto slot = pm_instance->Allocate(1, PG_PTable_Maped | PG_Active | PG_Zeroed);
         list_init(&slot->list);
         task->mm->physical_page_list = slot->list;
         pml4_entry = (Page_PML4 *)Phy_To_Virt(slot->physical_address);
-        bzero(pml4_entry, 0x1000);
     }
 
     Page_PDPE *pdpe = (Page_PDPE *)Phy_To_Virt(pml4_entry[pml4_offset].PDPE << PAGE_4K_SHIFT);
-    if ((uint64_t)pdpe == PAGE_OFFSET)
+    if ((uint64_t)pdpe == DIRECT_MAP_BASE)
     {
-        auto slot = pm_instance->Allocate(1, PG_PTable_Maped | PG_Active);
-        bzero(Phy_To_Virt(slot->physical_address), 0x1000);
+        auto slot = pm_instance->Allocate(1, PG_PTable_Maped | PG_Active | PG_Zeroed);
         list_add_to_behind(&task->mm->physical_page_list, &slot->list);
         pml4_entry[pml4_offset].PDPE = (uint64_t)slot->physical_address >> PAGE_4K_SHIFT;
         *(uint64_t *)&pml4_entry[pml4_offset] |= attributes;
@@ -160,10 +187,9 @@ int vmap_frame(task_struct *task, uint64_t vstart, uint64_t attributes)
     }
 
     Page_PDE *pde = (Page_PDE *)Phy_To_Virt(pdpe[pdpe_offset].NEXT << PAGE_4K_SHIFT);
-    if ((uint64_t)pde == PAGE_OFFSET)
+    if ((uint64_t)pde == DIRECT_MAP_BASE)
     {
-        auto slot = pm_instance->Allocate(1, PG_PTable_Maped | PG_Active);
-        bzero(Phy_To_Virt(slot->physical_address), 0x1000);
+        auto slot = pm_instance->Allocate(1, PG_PTable_Maped | PG_Active | PG_Zeroed);
         list_add_to_behind(&task->mm->physical_page_list, &slot->list);
         pdpe[pdpe_offset].NEXT = (uint64_t)slot->physical_address >> PAGE_4K_SHIFT;
         *(uint64_t *)&pdpe[pdpe_offset] |= attributes;
@@ -171,10 +197,9 @@ int vmap_frame(task_struct *task, uint64_t vstart, uint64_t attributes)
     }
 
     Page_PTE *pte = (Page_PTE *)Phy_To_Virt(pde[pde_offset].NEXT << PAGE_4K_SHIFT);
-    if ((uint64_t)pte == PAGE_OFFSET)
+    if ((uint64_t)pte == DIRECT_MAP_BASE)
     {
-        auto slot = pm_instance->Allocate(1, PG_PTable_Maped | PG_Active);
-        bzero(Phy_To_Virt(slot->physical_address), 0x1000);
+        auto slot = pm_instance->Allocate(1, PG_PTable_Maped | PG_Active | PG_Zeroed);
         list_add_to_behind(&task->mm->physical_page_list, &slot->list);
         pde[pde_offset].NEXT = (uint64_t)slot->physical_address >> PAGE_4K_SHIFT;
         *(uint64_t *)&pde[pde_offset] |= attributes;
@@ -186,16 +211,78 @@ int vmap_frame(task_struct *task, uint64_t vstart, uint64_t attributes)
         return -1;
     }
 
-    auto max_vmap_count = 511 - pte_offset;
+    auto max_vmap_count = 512 - pte_offset;
     max_vmap_count = max_vmap_count > 16 ? 16 : max_vmap_count;
-    auto slot = pm_instance->Allocate(max_vmap_count, PG_PTable_Maped | PG_Active);
-    bzero(Phy_To_Virt(slot->physical_address), 0x1000 * max_vmap_count);
-    list_add_to_behind(&task->mm->physical_page_list, &slot->list);
-    for (uint64_t i = 0; i <= max_vmap_count; ++i)
+    // single pages come out of the pool zeroed at idle time
+    for (uint64_t i = 0; i < max_vmap_count && pte[pte_offset + i].P == 0; ++i)
     {
-        pte[pte_offset + i].PPBA = ((uint64_t)slot->physical_address + i * 0x1000) >> PAGE_4K_SHIFT;
+        auto slot = pm_instance->Allocate(1, PG_PTable_Maped | PG_Active | PG_Zeroed);
+        if (!slot)
+            break;
+        list_add_to_behind(&task->mm->physical_page_list, &slot->list);
+        pte[pte_offset + i].PPBA = (uint64_t)slot->physical_address >> PAGE_4K_SHIFT;
         *(uint64_t *)&pte[pte_offset + i] |= attributes;
     }
 
     return 0;
 }
+
+// pte of vaddr in mm, nullptr if a table on the way is missing
+static Page_PTE *user_pte_of(mm_struct *mm, uint64_t vaddr)
+{
+    if (!mm->pml4)
+        return nullptr;
+    auto &pml4_entry = mm->pml4[(vaddr >> 39) & 0x1ff];
+    if (!pml4_entry.P)
+        return nullptr;
+    auto &pdpe = ((Page_PDPE *)Phy_To_Virt(pml4_entry.PDPE << PAGE_4K_SHIFT))[(vaddr >> 30) & 0x1ff];
+    if (!pdpe.P)
+        return nullptr;
+    auto &pde = ((Page_PDE *)Phy_To_Virt(pdpe.NEXT << PAGE_4K_SHIFT))[(vaddr >> 21) & 0x1ff];
+    if (!pde.P)
+        return nullptr;
+    return &((Page_PTE *)Phy_To_Virt(pde.NEXT << PAGE_4K_SHIFT))[(vaddr >> 12) & 0x1ff];
+}
+
+int vunmap_range(task_struct *task, uint64_t vstart, uint64_t count)
+{
+    if (!task->mm)
+        return -1;
+
+    auto pm_instance = PhysicalMemory::GetInstance();
+    TlbBatch batch;
+    tlb_batch_init(&batch, task->mm);
+
+    // clear every pte first, pages are freed only when no tlb can reach them
+    List freed;
+    list_init(&freed);
+    for (uint64_t i = 0; i < count; ++i)
+    {
+        auto vaddr = vstart + i * PAGE_4K_SIZE;
+        auto pte = user_pte_of(task->mm, vaddr);
+        if (!pte || !pte->P)
+            continue;
+        auto page = pm_instance->PageOf((uint64_t)pte->PPBA << PAGE_4K_SHIFT);
+        *(uint64_t *)pte = 0;
+        tlb_batch_add(&batch, (void *)vaddr, PAGE_4K_SIZE);
+        if (!page)
+            continue;
+        list_del(&page->list);
+        list_add_to_behind(&freed, &page->list);
+    }
+
+    tlb_batch_flush(&batch);
+
+    while (!list_is_empty(&freed))
+    {
+        auto page = container_of(list_next(&freed), Page, list);
+        list_del(&page->list);
+        pm_instance->Free(page);
+    }
+    return 0;
+}
+
+int vunmap_frame(task_struct *task, uint64_t vstart)
+{
+    return vunmap_range(task, vstart, 1);
+}
@@ -2,9 +2,15 @@
 
 #include <thread/task.h>
 
-// vstart must aligned to 4K
+// build the direct map of the first PHYSICAL_MAPPED_END
 void vmap_init();
+// add [start, end) to the direct map, -1 if it is out of range or out of memory
+int direct_map_range(uint64_t start, uint64_t end);
+// vstart must aligned to 4K
 int vmap_frame(task_struct *task, uint64_t vstart, uint64_t attributes);
+// unmap count pages from vstart and free them, one shootdown for all of them
+int vunmap_range(task_struct *task, uint64_t vstart, uint64_t count);
+int vunmap_frame(task_struct *task, uint64_t vstart);
 
 // alloc physical page manually
 int vmap_frame_kernel(uint8_t*vaddr, uint8_t*paddr);
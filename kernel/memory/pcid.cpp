@@ -0,0 +1,80 @@
+#include "pcid.h"
+#include "physical.h"
+#include "tlb.h"
+#include <thread/task.h>
+#include <smp/cpu.h>
+#include <std/cpu_features.h>
+#include <std/spinlock.h>
+
+// keep the tlb entries tagged with the new pcid
+#define CR3_NOFLUSH (1UL << 63)
+
+extern "C" char pml4;
+
+static Spinlock pcid_lock;
+// bumped when the pcids run out, a cpu flushes everything before it uses a newer one
+// read without the lock on the fast path of pcid_assign
+static volatile uint64_t pcid_generation = 1;
+static uint64_t pcid_next = 1;
+
+// returns mm->pcid_tag, assigning a pcid of the current generation if needed
+static uint64_t pcid_assign(mm_struct *mm)
+{
+    // nearly every switch, the pcid is still current and the lock not needed
+    uint64_t tag = mm->pcid_tag;
+    if (tag >> PCID_SHIFT == pcid_generation)
+        return tag;
+
+    pcid_lock.lock();
+    tag = mm->pcid_tag;
+    if (tag >> PCID_SHIFT != pcid_generation)
+    {
+        if (pcid_next == PCID_NUM)
+        {
+            pcid_generation = pcid_generation + 1;
+            pcid_next = 1;
+        }
+        tag = pcid_generation << PCID_SHIFT | pcid_next++;
+        mm->pcid_tag = tag;
+    }
+    pcid_lock.unlock();
+    return tag;
+}
+
+static inline void write_cr3(uint64_t cr3)
+{
+    asm volatile("movq %0, %%cr3" ::"r"(cr3)
+                 : "memory");
+}
+
+void switch_mm(mm_struct *mm)
+{
+    // publish first, then look at cpu_mask, tlb_batch_flush does the opposite
+    this_cpu->active_mm = mm;
+    asm volatile("mfence" ::
+                     : "memory");
+    // dropped from cpu_mask means a shootdown skipped this cpu
+    bool cached = mm && cpu_mask_test_and_set(mm->cpu_mask, this_cpu->apic_id);
+
+    uint64_t cr3 = mm ? (uint64_t)Virt_To_Phy(mm->pml4) : (uint64_t)&pml4;
+    if (!cpu_has(CPU_FEATURE_PCID))
+        return write_cr3(cr3);
+
+    // pcid 0 is never handed out again
+    if (!mm)
+        return write_cr3(cr3 | CR3_NOFLUSH);
+
+    // mm->pcid_tag may be reassigned meanwhile, use only this snapshot
+    auto tag = pcid_assign(mm);
+    auto generation = tag >> PCID_SHIFT;
+    cr3 |= tag & (PCID_NUM - 1);
+    if (this_cpu->pcid_generation != generation)
+    {
+        // pcids of the older generation now belong to other address spaces
+        this_cpu->pcid_generation = generation;
+        write_cr3(cr3);
+        tlb_flush_global();
+        return;
+    }
+    write_cr3(cached ? cr3 | CR3_NOFLUSH : cr3);
+}
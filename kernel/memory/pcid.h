@@ -0,0 +1,12 @@
+#pragma once
+#include <std/stdint.h>
+
+struct mm_struct;
+
+// pcid 0 is the kernel pml4, address spaces get 1 to PCID_NUM - 1
+#define PCID_NUM 4096
+#define PCID_SHIFT 12
+
+// load mm on this cpu, nullptr is the kernel pml4
+// with pcids the tlb entries of the previous address space are kept
+void switch_mm(mm_struct *mm);
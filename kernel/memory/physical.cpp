@@ -6,6 +6,9 @@
 #include "flags.h"
 #include "zone.h"
 #include <memory/heap.h>
+#include <smp/cpu.h>
+#include <acpi/srat.h>
+#include "mapping.h"
 
 uint64_t PhysicalMemory::Add(multiboot_mmap_entry *mmap)
 {
@@ -20,70 +23,281 @@ uint64_t PhysicalMemory::Add(multiboot_mmap_entry *mmap)
         return 0;
     }
 
-    if (end - start < 0x8000000) {
-        printk("region less than 128Mb, dropped\n");
-        return 0;
+    // a zone never spans two nodes
+    uint64_t zone_end = 0;
+    auto srat = SRAT::GetInstance();
+    while (start < end)
+    {
+        auto piece_end = srat->NodeBoundary(start, end);
+        zone_end = this->AddZone(start, piece_end, srat->NodeOf(start));
+        start = piece_end;
     }
 
-    if (start >= 0x100000000) {
-        printk("todo: add map for 4G+ mem\n");
+    return zone_end;
+}
+
+uint64_t PhysicalMemory::AddZone(uint64_t start, uint64_t end, uint32_t node)
+{
+    // vmap_init only mapped the low memory
+    if (end > PHYSICAL_MAPPED_END && direct_map_range(start, end) != 0)
+    {
+        printk("region can't be direct mapped, dropped\n");
         return 0;
     }
 
     // auto zone_addr = brk_up(sizeof(Zone));
     auto valid_start = (uint64_t)Virt_To_Phy(brk_get());
-    uint8_t* zone_addr = nullptr;
-    if (start > valid_start) {
-        zone_addr = (uint8_t*)start;
-    }else if (start < valid_start && valid_start < end) {
-        zone_addr = (uint8_t*)valid_start;
+    if (end <= valid_start)
+        return 0;
+    if (start < valid_start)
         start = valid_start;
-    }else {
+
+    // the zone and its metadata live at the start of the region
+    if (PAGE_4K_ROUND_UP(Zone::MetadataSize((end - start) / PAGE_4K_SIZE)) >= end - start)
+    {
+        printk("region can't hold its zone metadata, dropped\n");
         return 0;
     }
-    zone_addr = Phy_To_Virt(zone_addr);
-    auto zone = new (zone_addr) Zone((uint8_t *)start, (uint8_t *)end);
+    auto zone = new (Phy_To_Virt(start)) Zone((uint8_t *)start, (uint8_t *)end, ZONE_NORMAL, node);
+
+    // keep zones sorted by address, the lowest zone is the list head
     if (!zones_list)
     {
         this->zones_list = &zone->list_node;
     }
     else
     {
-        list_add_to_behind(this->zones_list, &zone->list_node);
+        auto node = this->zones_list;
+        do
+        {
+            if (((Zone *)node)->PhysicalStart() > start)
+                break;
+            node = node->next;
+        } while (node != this->zones_list);
+        list_add_to_before(node, &zone->list_node);
+        if (((Zone *)this->zones_list)->PhysicalStart() > start)
+            this->zones_list = &zone->list_node;
+    }
+
+    // each lookup slot points to the lowest zone overlapping it
+    for (uint64_t slot = start >> ZONE_LOOKUP_SHIFT; slot < ZONE_LOOKUP_NUM && (slot << ZONE_LOOKUP_SHIFT) < end; ++slot)
+    {
+        if (!this->zone_lookup[slot] || this->zone_lookup[slot]->PhysicalStart() > start)
+            this->zone_lookup[slot] = zone;
     }
 
     return zone->End();
 }
 
+uint32_t PhysicalMemory::LocalNode()
+{
+    // this_cpu is only usable once the cpu caches are on
+    return this->cache_enabled ? this_cpu->node : 0;
+}
+
+Zone *PhysicalMemory::NextZone(Zone *zone)
+{
+    if (!zone)
+        return (Zone *)this->zones_list;
+
+    auto node = zone->list_node.next;
+    return node == this->zones_list ? nullptr : (Zone *)node;
+}
+
 Page *PhysicalMemory::Allocate(uint64_t count, uint64_t page_flags)
 {
-    auto zone = (Zone *)(this->zones_list);
-    auto idx = zone->AllocatePages(count);
-    if (idx != -1)
+    Page *page = nullptr;
+    // pages zeroed at idle time keep the memset off this path
+    if (count == 1 && (page_flags & PG_Zeroed))
+        page = this->ZeroedAllocate();
+    bool zeroed = page != nullptr;
+
+    if (!page && count == 1 && this->cache_enabled)
     {
-        for (int i = idx; i < idx + count; ++i)
+        page = this->CacheAllocate();
+    }
+    else if (!page)
+    {
+        // local node first, then fall back across zones, lowest address first
+        auto node = this->LocalNode();
+        for (int pass = 0; pass < 2 && !page; ++pass)
         {
-            zone->Pages()[idx].attributes |= page_flags;
-            zone->Pages()[idx].reference_count = 1;
+            for (auto zone = this->NextZone(nullptr); zone && !page; zone = this->NextZone(zone))
+            {
+                if ((zone->Node() == node) != (pass == 0))
+                    continue;
+                auto idx = zone->AllocatePages(count);
+                if (idx != -1)
+                    page = &zone->Pages()[idx];
+            }
         }
-        // printk("alloc: %p to %p\n", zone->Pages()[idx].physical_address, zone->Pages()[idx + count - 1].physical_address + 0x1000);
-        return &zone->Pages()[idx];
     }
-    return nullptr;
+
+    // the pool is free memory too
+    if (!page && count == 1)
+        zeroed = (page = this->ZeroedAllocate()) != nullptr;
+    if (!page)
+        return nullptr;
+
+    if ((page_flags & PG_Zeroed) && !zeroed)
+        bzero(Phy_To_Virt(page->physical_address), count * PAGE_4K_SIZE);
+    page_flags &= ~PG_Zeroed;
+
+    for (uint64_t i = 0; i < count; ++i)
+    {
+        page[i].attributes |= page_flags;
+        page[i].reference_count = 1;
+    }
+    // printk("alloc: %p to %p\n", page->physical_address, page[count - 1].physical_address + 0x1000);
+    return page;
 }
 
 void PhysicalMemory::Free(Page *page)
 {
-    auto zone = (Zone *)(this->zones_list);
-    auto start_page = zone->Pages();
-    auto diff = page - start_page;
-    zone->FreePages(diff);
+    if (page->buddy_order == 0 && this->cache_enabled)
+        return this->CacheFree(page);
+
+    auto zone = page->zone;
+    zone->FreePages(page - zone->Pages());
+}
+
+// page cache for the bsp, aps get theirs from InitCpuCache
+static PageFrameCache BootPageFrameCache;
+
+void PhysicalMemory::InitCpuCache(cpu_struct *cpu)
+{
+    if (cpu->pcp)
+        return;
+
+    if (cpu == &CPU::GetInstance()->Get())
+    {
+        cpu->pcp = &BootPageFrameCache;
+        return;
+    }
+
+    auto page = this->Allocate(PAGE_4K_ROUND_UP(sizeof(PageFrameCache)) / PAGE_4K_SIZE, 0);
+    cpu->pcp = (PageFrameCache *)Phy_To_Virt(page->physical_address);
+    cpu->pcp->count = 0;
+}
+
+void PhysicalMemory::EnableCpuCache()
+{
+    this->cache_enabled = true;
+}
+
+Page *PhysicalMemory::CacheAllocate()
+{
+    Page *page = nullptr;
+    // an interrupt on this cpu may allocate too
+    asm volatile("pushf");
+    asm volatile("cli");
+    auto pcp = this_cpu->pcp;
+    for (int pass = 0; pass < 2 && pcp->count == 0; ++pass)
+    {
+        for (auto zone = this->NextZone(nullptr); zone && pcp->count == 0; zone = this->NextZone(zone))
+        {
+            if ((zone->Node() == this_cpu->node) != (pass == 0))
+                continue;
+            pcp->count = zone->AllocatePagesBatch(pcp->pages, PCP_BATCH);
+        }
+    }
+    if (pcp->count > 0)
+        page = pcp->pages[--pcp->count];
+    asm volatile("popf");
+    return page;
+}
+
+void PhysicalMemory::CacheFree(Page *page)
+{
+    asm volatile("pushf");
+    asm volatile("cli");
+    auto pcp = this_cpu->pcp;
+    if (pcp->count == PCP_HIGH)
+    {
+        // the bottom of the stack is the coldest, give it back
+        uint64_t start = 0;
+        while (start < PCP_BATCH)
+        {
+            auto zone = pcp->pages[start]->zone;
+            uint64_t end = start + 1;
+            while (end < PCP_BATCH && pcp->pages[end]->zone == zone)
+                ++end;
+            zone->FreePagesBatch(&pcp->pages[start], end - start);
+            start = end;
+        }
+        memcpy(pcp->pages, &pcp->pages[PCP_BATCH], sizeof(Page *) * (PCP_HIGH - PCP_BATCH));
+        pcp->count -= PCP_BATCH;
+    }
+    pcp->pages[pcp->count++] = page;
+    asm volatile("popf");
+}
+
+Page *PhysicalMemory::ZeroedAllocate()
+{
+    Page *page = nullptr;
+    asm volatile("pushf");
+    asm volatile("cli");
+    this->zeroed_lock.lock();
+    if (this->zeroed_count > 0)
+        page = this->zeroed_pool[--this->zeroed_count];
+    this->zeroed_lock.unlock();
+    asm volatile("popf");
+    return page;
+}
+
+bool PhysicalMemory::RefillZeroedPool()
+{
+    for (int i = 0; i < ZEROED_POOL_BATCH && this->zeroed_count < ZEROED_POOL_HIGH; ++i)
+    {
+        auto page = this->Allocate(1, 0);
+        if (!page)
+            return false;
+        // nobody reads the page before it is handed out, don't pull it into the cache
+        bzero_nt(Phy_To_Virt(page->physical_address), PAGE_4K_SIZE);
+
+        bool pooled = false;
+        asm volatile("pushf");
+        asm volatile("cli");
+        this->zeroed_lock.lock();
+        if (this->zeroed_count < ZEROED_POOL_HIGH)
+        {
+            this->zeroed_pool[this->zeroed_count++] = page;
+            pooled = true;
+        }
+        this->zeroed_lock.unlock();
+        asm volatile("popf");
+
+        // another cpu filled the pool meanwhile
+        if (!pooled)
+        {
+            this->Free(page);
+            return false;
+        }
+    }
+    return this->zeroed_count < ZEROED_POOL_HIGH;
+}
+
+Page *PhysicalMemory::PageOf(uint64_t physical_address)
+{
+    auto slot = physical_address >> ZONE_LOOKUP_SHIFT;
+    auto zone = slot < ZONE_LOOKUP_NUM ? this->zone_lookup[slot] : this->NextZone(nullptr);
+    for (; zone; zone = this->NextZone(zone))
+    {
+        if (zone->PhysicalStart() > physical_address)
+            break;
+        auto page = zone->PageOf(physical_address);
+        if (page)
+            return page;
+    }
+
+    return nullptr;
 }
 
 bool PhysicalMemory::Reserve(uint64_t physical_address)
 {
-    auto zone = (Zone *)(this->zones_list);
     physical_address &= PAGE_4K_MASK_LOW;
-    zone->Reserve((physical_address - 0x100000) / PAGE_4K_SIZE);
-    return true;
+    auto page = this->PageOf(physical_address);
+    if (!page)
+        return true;
+    return page->zone->Reserve(page - page->zone->Pages());
 }
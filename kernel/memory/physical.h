@@ -5,18 +5,7 @@
 #include "physical_page.h"
 #include <std/printk.h>
 #include <std/singleton.h>
-
-#define flush_tlb()               \
-    do                            \
-    {                             \
-        unsigned long tmpreg;     \
-        asm volatile(             \
-            "movq	%%cr3,	%0	\n\t" \
-            "movq	%0,	%%cr3	\n\t" \
-            : "=r"(tmpreg)        \
-            :                     \
-            : "memory");          \
-    } while (0)
+#include <std/spinlock.h>
 
 inline uint8_t *get_cr3()
 {
@@ -40,6 +29,31 @@ inline void set_cr3(void *pml4)
 
 class multiboot_mmap_entry;
 class MBI2;
+class Zone;
+struct cpu_struct;
+
+// physical memory vmap_init puts in the direct map, regions above are mapped as zones are added
+#define PHYSICAL_MAPPED_END 0x100000000UL
+
+// PageOf finds zones through slots of 1GB physical memory
+#define ZONE_LOOKUP_SHIFT PAGE_1G_SHIFT
+#define ZONE_LOOKUP_NUM 512
+
+// order-0 pages a cpu keeps in front of the zones
+#define PCP_HIGH 64
+// pages moved between a cpu cache and the zones at once
+#define PCP_BATCH 32
+
+// pages zeroed ahead of time for PG_Zeroed allocations
+#define ZEROED_POOL_HIGH 256
+// pages an idle cpu zeroes before it checks for work again
+#define ZEROED_POOL_BATCH 16
+
+struct PageFrameCache
+{
+    uint64_t count;
+    Page *pages[PCP_HIGH];
+};
 
 class PhysicalMemory : public Singleton<PhysicalMemory>
 {
@@ -47,11 +61,34 @@ public:
     Page *Allocate(uint64_t count, uint64_t page_flags);
     void Free(Page *page);
     bool Reserve(uint64_t physical_address);
+    // Page describing physical_address, nullptr if no zone covers it
+    Page *PageOf(uint64_t physical_address);
+    // give cpu its page cache, the cache is used once EnableCpuCache is called
+    void InitCpuCache(cpu_struct *cpu);
+    // this_cpu must be valid on every cpu that allocates from now on
+    void EnableCpuCache();
+    // numa node of the calling cpu
+    uint32_t LocalNode();
+    // zero a batch of free pages for PG_Zeroed, called from idle loops
+    // false once the pool is full or memory ran out
+    bool RefillZeroedPool();
 
 private:
+    Page *CacheAllocate();
+    void CacheFree(Page *page);
+    Page *ZeroedAllocate();
     friend class MBI2;
     friend void basic_init(void *mbi_addr);
-    void Add(multiboot_mmap_entry *mmap);
+    uint64_t Add(multiboot_mmap_entry *mmap);
+    uint64_t AddZone(uint64_t start, uint64_t end, uint32_t node);
+    // zones in address order, nullptr starts from the first one
+    Zone *NextZone(Zone *zone);
 
     List *zones_list;
+    Zone *zone_lookup[ZONE_LOOKUP_NUM];
+    bool cache_enabled;
+
+    Spinlock zeroed_lock;
+    Page *zeroed_pool[ZEROED_POOL_HIGH];
+    uint64_t zeroed_count;
 };
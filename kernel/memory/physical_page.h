@@ -1,14 +1,22 @@
 #pragma once
 #include <std/stdint.h>
 #include <std/list.h>
+// the kernel image and its brk area
 #define PAGE_OFFSET 0xFFFFFFFF00000000
-#define Virt_To_Phy(addr) ((uint8_t *)(addr)-PAGE_OFFSET)
-#define Phy_To_Virt(addr) ((uint8_t *)((uint8_t *)(addr) + PAGE_OFFSET))
+// every page of physical memory, built by vmap_init
+#define DIRECT_MAP_BASE 0xFFFF888000000000
+// one pdpe page worth of direct map
+#define DIRECT_MAP_SIZE (1UL << 39)
+#define DIRECT_MAP_PML4_INDEX ((DIRECT_MAP_BASE >> 39) & 0x1ff)
+// kernel image addresses and direct map addresses both translate back
+#define Virt_To_Phy(addr) ((uint8_t *)((uint64_t)(addr) >= PAGE_OFFSET ? (uint64_t)(addr)-PAGE_OFFSET : (uint64_t)(addr)-DIRECT_MAP_BASE))
+#define Phy_To_Virt(addr) ((uint8_t *)((uint8_t *)(addr) + DIRECT_MAP_BASE))
 
 #define PAGE_1G_SHIFT 30
 #define PAGE_2M_SHIFT 21
 #define PAGE_4K_SHIFT 12
 
+#define PAGE_1G_SIZE (1UL << PAGE_1G_SHIFT)
 #define PAGE_2M_SIZE (1UL << PAGE_2M_SHIFT)
 #define PAGE_4K_SIZE (1UL << PAGE_4K_SHIFT)
 
@@ -28,6 +36,8 @@
 #define PAGE_2M_ROUND_DOWN(addr) (addr & PAGE_2M_MASK_LOW)
 
 class Zone;
+struct Descriptor;
+struct SlabNode;
 struct Page
 {
     Zone *zone;
@@ -35,4 +45,15 @@ struct Page
     List list;
     uint16_t reference_count;
     uint16_t attributes;
+    // order of the run this page heads, kept by the buddy engine
+    uint8_t buddy_order;
+    // set while the page heads a free run
+    uint8_t buddy_free;
+    union
+    {
+        // lrmalloc superblock owning this page, nullptr for whole page runs
+        Descriptor *desc;
+        // slab node owning this page, for pages allocated with PG_Slab
+        SlabNode *slab_node;
+    };
 };
\ No newline at end of file
@@ -1,73 +1,120 @@
 #include "slab.h"
 #include "kmalloc.h"
 #include "physical.h"
+#include "flags.h"
 
 #include <std/printk.h>
 #include <std/kstring.h>
 #include <std/debug.h>
 #include <std/new.h>
 #include <std/math.h>
+#include <std/lock_guard.h>
 
-static SlabNode *slab_node_create(uint64_t object_size)
-{
-    auto slab_node = new SlabNode();
-    if (!slab_node)
-    {
-        printk("!slab_node\n");
-        return nullptr;
-    }
-    bzero(slab_node, sizeof(SlabNode));
+// a slab node grows until it holds at least this many objects
+#define SLAB_MIN_OBJECTS 8
 
-    slab_node->free_count = PAGE_4K_SIZE / object_size == 0 ? 1 : PAGE_4K_SIZE / object_size;
-    auto bitmap_size = (slab_node->free_count / 8) == 0 ? 1 : (slab_node->free_count / 8);
-    slab_node->bitmap = new Bitmap(bitmap_size);
-    if (!slab_node->bitmap)
+#define SLAB_ROUND_UP(x, align) (((x) + (align)-1) & ~((uint64_t)(align)-1))
+
+#define SLAB_LINK(slab, object) (*(uint8_t **)((object) + (slab)->link_offset))
+
+static SlabNode *slab_node_create(Slab *slab)
+{
+    auto page = PhysicalMemory::GetInstance()->Allocate(slab->node_pages, PG_Slab);
+    if (!page)
     {
-        printk("!slab_node->bitmap\n");
-        kfree(slab_node);
+        printk("!slab_node page\n");
         return nullptr;
     }
 
-    slab_node->vaddr = (uint8_t *)kmalloc(PAGE_4K_SIZE, 0);
+    // free finds the node through any page of it
+    auto slab_node = (SlabNode *)Phy_To_Virt(page->physical_address);
+    for (uint32_t i = 0; i < slab->node_pages; ++i)
+        page[i].slab_node = slab_node;
 
-    if (!slab_node->vaddr)
+    list_init(&slab_node->list);
+    slab_node->slab = slab;
+    slab_node->used_count = 0;
+    slab_node->total_count = slab->node_objects;
+
+    // shift each node a little so objects of different nodes
+    //  don't all compete for the same cache sets
+    auto colour = slab->colour_next;
+    slab->colour_next += slab->align;
+    if (slab->colour_next > slab->colour_max)
+        slab->colour_next = 0;
+
+    // thread all objects into the free list
+    auto object = (uint8_t *)slab_node + SLAB_ROUND_UP(sizeof(SlabNode), slab->align) + colour;
+    slab_node->free = object;
+    for (uint32_t i = 0; i < slab_node->total_count; ++i)
     {
-        printk("!slab_node->vaddr\n");
-        delete slab_node->bitmap;
-        kfree(slab_node);
-        return nullptr;
+        if (slab->ctor)
+            slab->ctor(object);
+        auto next = object + slab->object_size;
+        SLAB_LINK(slab, object) = i + 1 < slab_node->total_count ? next : nullptr;
+        object = next;
     }
 
+    slab->total_free += slab_node->total_count;
     return slab_node;
 }
 
-Slab *slab_create(uint64_t object_size)
+static void slab_node_release(SlabNode *slab_node)
 {
-    object_size = ROUND_UP_8BYTES(object_size);
+    slab_node->slab->total_free -= slab_node->total_count;
+    auto page = PhysicalMemory::GetInstance()->PageOf((uint64_t)Virt_To_Phy(slab_node));
+    PhysicalMemory::GetInstance()->Free(page);
+}
 
-    auto slab = new Slab();
-    if (!slab)
+Slab *slab_create_aligned(uint64_t object_size, uint64_t align, slab_ctor_t ctor)
+{
+    if (align < sizeof(uint64_t))
+        align = sizeof(uint64_t);
+    if (align & (align - 1))
     {
-        printk("!slab\n");
+        printk("slab align %d is not a power of 2\n", align);
         return nullptr;
     }
-    bzero(slab, sizeof(Slab));
 
-    auto slab_node = slab_node_create(object_size);
-    if (!slab_node)
+    auto slab = new Slab();
+    if (!slab)
     {
-        printk("!slab_node\n");
-        kfree(slab);
+        printk("!slab\n");
         return nullptr;
     }
 
-    list_init(&slab_node->list);
-    slab_node->slab = slab;
+    // a free object holds the next pointer, behind the object if it has a ctor
+    object_size = ROUND_UP_8BYTES(object_size);
+    slab->link_offset = ctor ? object_size : 0;
+    if (ctor || object_size == 0)
+        object_size += sizeof(uint8_t *);
+    object_size = SLAB_ROUND_UP(object_size, align);
 
     slab->object_size = object_size;
+    slab->align = align;
+    slab->ctor = ctor;
+
+    auto header_size = SLAB_ROUND_UP(sizeof(SlabNode), align);
+    slab->node_pages = 1;
+    while ((slab->node_pages * PAGE_4K_SIZE - header_size) / object_size < SLAB_MIN_OBJECTS)
+        slab->node_pages *= 2;
+    auto usable = slab->node_pages * PAGE_4K_SIZE - header_size;
+    slab->node_objects = usable / object_size;
+    slab->colour_max = usable - slab->node_objects * object_size;
+    slab->colour_next = 0;
+
     slab->total_used = 0;
-    slab->total_free = slab_node->free_count;
-    slab->pool = slab_node;
+    slab->total_free = 0;
+    list_init(&slab->partial);
+    list_init(&slab->full);
+    slab->empty = nullptr;
+
+    return slab;
+}
+
+Slab *slab_create(uint64_t object_size)
+{
+    return slab_create_aligned(object_size, sizeof(uint64_t), nullptr);
 }
 
 int slab_free(Slab *slab)
@@ -77,70 +124,104 @@ int slab_free(Slab *slab)
         printk("slab->total_used != 0\n");
         return -1;
     }
+
+    // nothing is in use, so only the cached empty node can be left
+    if (slab->empty)
+        slab_node_release(slab->empty);
+    delete slab;
+    return 0;
 }
 
-uint8_t*Slab::Alloc()
+uint8_t *Slab::AllocLocked()
 {
-    SlabNode *selected_node = this->pool;
-
-    if (this->total_free == 0)
+    SlabNode *selected_node = nullptr;
+    if (!list_is_empty(&this->partial))
     {
-        auto slab_node = slab_node_create(this->object_size);
-        if (!slab_node)
-        {
-            printk("!slab_node\n");
+        selected_node = container_of(list_next(&this->partial), SlabNode, list);
+    }
+    else
+    {
+        selected_node = this->empty ? this->empty : slab_node_create(this);
+        if (!selected_node)
             return nullptr;
-        }
-        this->total_free += slab_node->free_count;
-        list_add_to_behind(&this->pool->list, &slab_node->list);
-        selected_node = slab_node;
+        this->empty = nullptr;
+        list_add_to_behind(&this->partial, &selected_node->list);
     }
 
-    do
+    auto object = selected_node->free;
+    selected_node->free = SLAB_LINK(this, object);
+    selected_node->used_count++;
+    this->total_free--;
+    this->total_used++;
+
+    if (!selected_node->free)
     {
-        // if the current node is full, check next
-        if (selected_node->free_count == 0)
-        {
-            selected_node = container_of(list_next(&selected_node->list), struct SlabNode, list);
-            continue;
-        }
-
-        for (int i = 0; i < selected_node->bitmap->Size(); ++i)
-        {
-
-            if (!selected_node->bitmap->IsSet(i))
-            {
-                selected_node->free_count--;
-                selected_node->used_count++;
-                this->total_free--;
-                this->total_used++;
-                selected_node->bitmap->Set(i);
-                return (uint8_t*)selected_node->vaddr + this->object_size * i;
-            }
-            panic("selected_node bit not found\n");
-        }
-
-    } while (selected_node != this->pool);
+        list_del(&selected_node->list);
+        list_add_to_behind(&this->full, &selected_node->list);
+    }
+
+    return object;
 }
 
-void Slab::Free(const uint8_t*ptr)
+void Slab::FreeLocked(const uint8_t *ptr)
 {
-    auto selected_node = this->pool;
-    do
+    auto page = PhysicalMemory::GetInstance()->PageOf((uint64_t)Virt_To_Phy(ptr));
+    auto selected_node = page->slab_node;
+    if (selected_node->slab != this)
+        panic("freeing object of another slab\n");
+
+    auto object = (uint8_t *)ptr;
+    bool was_full = !selected_node->free;
+    SLAB_LINK(this, object) = selected_node->free;
+    selected_node->free = object;
+    selected_node->used_count--;
+    this->total_free++;
+    this->total_used--;
+
+    if (selected_node->used_count == 0)
+    {
+        list_del(&selected_node->list);
+        if (!this->empty)
+            this->empty = selected_node;
+        else
+            slab_node_release(selected_node);
+    }
+    else if (was_full)
     {
-        auto vstart = selected_node->vaddr;
-        auto vend = vstart + this->object_size * (selected_node->used_count + selected_node->free_count);
-
-        if (vstart <= ptr && ptr < vend)
-        {
-            auto bit_offset = ((int8_t *)ptr - (int8_t *)vstart) / this->object_size;
-            selected_node->bitmap->UnSet(bit_offset);
-            selected_node->free_count++;
-            selected_node->used_count--;
-            selected_node->slab->total_free++;
-            selected_node->slab->total_used--;
-            return;
-        }
-
-    } while (selected_node != this->pool);
-}
\ No newline at end of file
+        list_del(&selected_node->list);
+        list_add_to_behind(&this->partial, &selected_node->list);
+    }
+}
+
+uint8_t *Slab::Alloc()
+{
+    LockGuard<Spinlock> lg(this->lock);
+    return this->AllocLocked();
+}
+
+void Slab::Free(const uint8_t *ptr)
+{
+    LockGuard<Spinlock> lg(this->lock);
+    this->FreeLocked(ptr);
+}
+
+uint32_t Slab::AllocBatch(void **objects, uint32_t count)
+{
+    LockGuard<Spinlock> lg(this->lock);
+    uint32_t allocated = 0;
+    for (; allocated < count; ++allocated)
+    {
+        auto object = this->AllocLocked();
+        if (!object)
+            break;
+        objects[allocated] = object;
+    }
+    return allocated;
+}
+
+void Slab::FreeBatch(void **objects, uint32_t count)
+{
+    LockGuard<Spinlock> lg(this->lock);
+    for (uint32_t i = 0; i < count; ++i)
+        this->FreeLocked((uint8_t *)objects[i]);
+}
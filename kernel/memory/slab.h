@@ -1,38 +1,71 @@
 #pragma once
 #include <std/list.h>
 #include <std/stdint.h>
-#include <std/bitmap.h>
+#include <std/spinlock.h>
 
 #include "physical_page.h"
 
 struct Slab;
 
+typedef void (*slab_ctor_t)(void *object);
+
+// header at the start of every slab page run
+// the objects follow it, free ones are linked through link_offset
 struct SlabNode
 {
     List list;
-    
+
     Slab *slab;
-    uint8_t*vaddr;
+    // first free object, nullptr when the node is full
+    uint8_t *free;
 
     uint32_t used_count;
-    uint32_t free_count;
-
-    Bitmap* bitmap;
+    uint32_t total_count;
 };
 
 struct Slab
 {
     uint32_t object_size;
+    uint32_t align;
+    // where a free object keeps the next free pointer
+    // past the object for caches with a ctor, so constructed state survives
+    uint32_t link_offset;
+    // pages of one SlabNode
+    uint32_t node_pages;
+    // objects per node and the bytes left over after them
+    uint32_t node_objects;
+    uint32_t colour_max;
+    // offset of the first object in the next node, cycles through the leftover
+    uint32_t colour_next;
+    slab_ctor_t ctor;
     uint32_t total_used;
     uint32_t total_free;
-    SlabNode *pool;
 
-    uint8_t*Alloc();
-    void Free(const uint8_t*ptr);
+    // nodes with at least one free and one used object
+    List partial;
+    // nodes without free objects
+    List full;
+    // one fully free node is kept around to absorb alloc/free churn
+    SlabNode *empty;
+
+    Spinlock lock;
+
+    uint8_t *Alloc();
+    void Free(const uint8_t *ptr);
+    // move up to count objects with one lock round trip
+    uint32_t AllocBatch(void **objects, uint32_t count);
+    void FreeBatch(void **objects, uint32_t count);
+
+private:
+    uint8_t *AllocLocked();
+    void FreeLocked(const uint8_t *ptr);
 };
 
 extern "C"
 {
     Slab *slab_create(uint64_t object_size);
     int slab_free(Slab *slab);
-}
\ No newline at end of file
+}
+
+// align must be a power of two, ctor runs once when an object is first carved
+Slab *slab_create_aligned(uint64_t object_size, uint64_t align, slab_ctor_t ctor);
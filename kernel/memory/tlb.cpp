@@ -0,0 +1,173 @@
+#include "tlb.h"
+#include "physical_page.h"
+#include <interrupt/apic.h>
+#include <interrupt/idt.h>
+#include <smp/cpu.h>
+#include <std/spinlock.h>
+#include <thread/task.h>
+
+#define CR4_PGE (1UL << 7)
+// global mappings only live in the kernel half
+#define KERNEL_HALF_START 0xffff800000000000UL
+
+void tlb_flush_range(void *vstart, uint64_t size)
+{
+    auto start = (uint64_t)vstart & PAGE_4K_MASK_LOW;
+    auto end = PAGE_4K_ALIGN((uint64_t)vstart + size);
+    if ((end - start) / PAGE_4K_SIZE > TLB_FLUSH_THRESHOLD)
+    {
+        if (end > KERNEL_HALF_START)
+            tlb_flush_global();
+        else
+            tlb_flush_all();
+        return;
+    }
+
+    for (auto addr = start; addr < end; addr += PAGE_4K_SIZE)
+        tlb_flush_page((void *)addr);
+}
+
+void tlb_flush_all()
+{
+    uint64_t cr3;
+    asm volatile("movq %%cr3, %0\n\t"
+                 "movq %0, %%cr3\n\t"
+                 : "=r"(cr3)
+                 :
+                 : "memory");
+}
+
+void tlb_flush_global()
+{
+    // toggling pge drops global translations as well
+    uint64_t cr4;
+    asm volatile("movq %%cr4, %0"
+                 : "=r"(cr4));
+    asm volatile("movq %0, %%cr4" ::"r"(cr4 & ~CR4_PGE)
+                 : "memory");
+    asm volatile("movq %0, %%cr4" ::"r"(cr4)
+                 : "memory");
+}
+
+void tlb_batch_init(TlbBatch *batch, mm_struct *mm)
+{
+    batch->mm = mm;
+    batch->count = 0;
+    batch->pages = 0;
+    batch->full = false;
+}
+
+void tlb_batch_add(TlbBatch *batch, void *vstart, uint64_t size)
+{
+    auto start = (uint64_t)vstart & PAGE_4K_MASK_LOW;
+    auto end = PAGE_4K_ALIGN((uint64_t)vstart + size);
+    batch->pages += (end - start) / PAGE_4K_SIZE;
+    if (batch->full || batch->count == TLB_BATCH_MAX || batch->pages > TLB_FLUSH_THRESHOLD)
+    {
+        batch->full = true;
+        return;
+    }
+    batch->ranges[batch->count].start = start;
+    batch->ranges[batch->count].end = end;
+    ++batch->count;
+}
+
+static void tlb_batch_flush_local(TlbBatch *batch)
+{
+    // user mappings aren't global, a cr3 reload drops them all
+    if (batch->full)
+        return tlb_flush_all();
+
+    for (uint32_t i = 0; i < batch->count; ++i)
+    {
+        for (auto addr = batch->ranges[i].start; addr < batch->ranges[i].end; addr += PAGE_4K_SIZE)
+            tlb_flush_page((void *)addr);
+    }
+}
+
+// one shootdown in flight, the ipi handlers read it
+static Spinlock shootdown_lock;
+static TlbBatch *volatile shootdown_batch;
+static volatile uint64_t shootdown_pending;
+
+void tlb_shootdown_handler(uint64_t error_code, uint64_t rsp, uint64_t rflags, uint64_t rip)
+{
+    auto batch = shootdown_batch;
+    // switched away since, the next switch in flushes
+    if (this_cpu->active_mm == batch->mm)
+        tlb_batch_flush_local(batch);
+    asm volatile("lock; decq %0"
+                 : "+m"(shootdown_pending)
+                 :
+                 : "memory");
+}
+
+void tlb_batch_flush(TlbBatch *batch)
+{
+    auto mm = batch->mm;
+    if (!batch->full && batch->count == 0)
+        return;
+
+    // no switch between the check and the flush or the clear
+    asm volatile("pushf");
+    asm volatile("cli");
+    auto self = this_cpu->apic_id;
+    if (this_cpu->active_mm == mm)
+        tlb_batch_flush_local(batch);
+    else
+        // like any other cpu not running mm, the next switch_mm flushes its pcid
+        cpu_mask_test_and_clear(mm->cpu_mask, self);
+    asm volatile("popf");
+
+    // clear first, then look, see switch_mm for the other side
+    uint64_t targets[CPU_MASK_WORDS] = {0};
+    uint64_t target_count = 0;
+    for (uint64_t word = 0; word < CPU_MASK_WORDS; ++word)
+    {
+        auto others = mm->cpu_mask[word];
+        if (word == self / 64)
+            others &= ~(1UL << (self % 64));
+        while (others)
+        {
+            auto cpu = word * 64 + __builtin_ctzl(others);
+            others &= others - 1;
+            cpu_mask_test_and_clear(mm->cpu_mask, cpu);
+            if (CPU::GetInstance()->Get(cpu).active_mm == mm)
+            {
+                cpu_mask_test_and_set(mm->cpu_mask, cpu);
+                targets[word] |= 1UL << (cpu % 64);
+                ++target_count;
+            }
+        }
+    }
+
+    if (target_count)
+    {
+        shootdown_lock.lock();
+        shootdown_batch = batch;
+        shootdown_pending = target_count;
+        auto apic = APIC::GetInstance();
+        for (uint64_t word = 0; word < CPU_MASK_WORDS; ++word)
+        {
+            while (targets[word])
+            {
+                auto cpu = word * 64 + __builtin_ctzl(targets[word]);
+                targets[word] &= targets[word] - 1;
+                apic->SendIPI(cpu, IPI_TLB_SHOOTDOWN);
+            }
+        }
+        while (shootdown_pending)
+            asm volatile("pause");
+        shootdown_lock.unlock();
+    }
+
+    tlb_batch_init(batch, mm);
+}
+
+void tlb_shootdown(mm_struct *mm, void *vstart, uint64_t size)
+{
+    TlbBatch batch;
+    tlb_batch_init(&batch, mm);
+    tlb_batch_add(&batch, vstart, size);
+    tlb_batch_flush(&batch);
+}
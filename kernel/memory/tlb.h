@@ -0,0 +1,75 @@
+#pragma once
+#include <std/stdint.h>
+
+// G bit of a leaf entry, the translation survives cr3 reloads
+// only for mappings every address space shares
+#define PAGE_GLOBAL (1UL << 8)
+
+// above this many pages one cr3 reload is cheaper than invlpg on each
+#define TLB_FLUSH_THRESHOLD 32
+// ranges one shootdown carries, more turn it into a full flush
+#define TLB_BATCH_MAX 16
+
+struct mm_struct;
+
+// all of these only act on the calling cpu
+
+inline void tlb_flush_page(void *vaddr)
+{
+    asm volatile("invlpg (%0)" ::"r"(vaddr)
+                 : "memory");
+}
+
+// pages of [vstart, vstart + size), falls back to a full flush above the threshold
+void tlb_flush_range(void *vstart, uint64_t size);
+// every non global translation
+void tlb_flush_all();
+// every translation, global ones included
+void tlb_flush_global();
+
+// mm_struct::cpu_mask has one bit per apic id of the cpus that may cache the mm
+inline bool cpu_mask_test_and_set(volatile uint64_t *mask, uint64_t cpu)
+{
+    bool old;
+    asm volatile("lock; btsq %2, %0"
+                 : "+m"(mask[cpu / 64]), "=@ccc"(old)
+                 : "r"(cpu % 64)
+                 : "memory");
+    return old;
+}
+
+inline bool cpu_mask_test_and_clear(volatile uint64_t *mask, uint64_t cpu)
+{
+    bool old;
+    asm volatile("lock; btrq %2, %0"
+                 : "+m"(mask[cpu / 64]), "=@ccc"(old)
+                 : "r"(cpu % 64)
+                 : "memory");
+    return old;
+}
+
+// user ranges of one mm invalidated on every cpu together
+struct TlbBatch
+{
+    mm_struct *mm;
+    uint32_t count;
+    uint64_t pages;
+    // too many ranges or pages, every cpu flushes the whole mm
+    bool full;
+    struct
+    {
+        uint64_t start;
+        uint64_t end;
+    } ranges[TLB_BATCH_MAX];
+};
+
+void tlb_batch_init(TlbBatch *batch, mm_struct *mm);
+void tlb_batch_add(TlbBatch *batch, void *vstart, uint64_t size);
+// cpus running mm get one ipi and are waited for, the others drop mm from
+// cpu_mask and flush it when they switch to it again
+// the caller must have interrupts enabled, two cpus may shoot down at once
+void tlb_batch_flush(TlbBatch *batch);
+// a batch of one range
+void tlb_shootdown(mm_struct *mm, void *vstart, uint64_t size);
+
+void tlb_shootdown_handler(uint64_t error_code, uint64_t rsp, uint64_t rflags, uint64_t rip);
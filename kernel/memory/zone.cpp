@@ -10,170 +10,109 @@
 #include <std/lock_guard.h>
 #include <memory/physical.h>
 
-#define LEFT_LEAF(index) ((index)*2 + 1)
-#define RIGHT_LEAF(index) ((index)*2 + 2)
-#define PARENT(index) (((index) + 1) / 2 - 1)
-
-#define IS_POWER_OF_2(x) (!((x) & ((x)-1)))
-#define MAX(a, b) ((a) > (b) ? (a) : (b))
-
 uint64_t Zone::PageSize()
 {
     return this->total_pages_count * sizeof(Page);
 }
 
-Zone::Zone(uint8_t *pstart, uint8_t *pend)
+Zone::Zone(uint8_t *pstart, uint8_t *pend, uint64_t attribute, uint32_t node)
 {
 
     list_init(&this->list_node);
 
     this->physical_start_address = (uint64_t)pstart;
     this->physical_end_address = (uint64_t)pend;
-    this->attribute = 0;
+    this->attribute = attribute;
+    this->node = node;
 
     uint64_t pages_count = (this->physical_end_address - this->physical_start_address) / PAGE_4K_SIZE;
     printk("page size: 4k, avaliable pages: %d\n", pages_count);
-    this->free_pages_count = pages_count;
     this->total_pages_count = pages_count;
-    this->total_pages_count_rounded_up = pages_count;
-
-    if (!IS_POWER_OF_2(pages_count))
-    {
-        this->total_pages_count_rounded_up = next_pow_of_2(pages_count);
-        printk("buddy page round %d\n", this->total_pages_count_rounded_up);
-    }
 
-    // node number is size * 2 - 1, we alloc size * 2
-    auto node_size = this->total_pages_count_rounded_up * 2;
-    // nodes placed at the end of the zone
-    auto zone_end = (int8_t *)this + sizeof(Zone);
-    this->nodes = (uint32_t *)zone_end;
-    auto nodes_end = zone_end + sizeof(this->nodes) * node_size;
-    // nodes placed at the end of the nodes
-    this->pages = (Page *)nodes_end;
-    auto pages_end = nodes_end + sizeof(Page) * this->total_pages_count;
+    // buddy metadata placed at the end of the zone
+    auto zone_end = (uint8_t *)this + sizeof(Zone);
+    auto metadata = zone_end;
+    auto metadata_end = metadata + BuddyEngine::MetadataSize(pages_count);
+    // pages placed at the end of the metadata
+    this->pages = (Page *)metadata_end;
+    auto pages_end = metadata_end + sizeof(Page) * this->total_pages_count;
 
     printk("zone start at %p -> %p\n", this, uint64_t(this) + sizeof(Zone));
-    printk("nodes start at %p -> %p\n", nodes, uint64_t(this->nodes) + node_size * sizeof(uint32_t));
+    printk("buddy metadata start at %p -> %p\n", metadata, metadata_end);
     printk("pages start at %p -> %p\n", pages, uint64_t(pages) + this->total_pages_count * sizeof(Page));
     this->zone_end = uint64_t(pages) + this->total_pages_count * sizeof(Page);
-    // build the buddy tree
-    for (int i = 0; i < 2 * this->total_pages_count_rounded_up - 1; ++i)
-    {
-        if (IS_POWER_OF_2(i + 1))
-            node_size /= 2;
-        this->nodes[i] = node_size;
-    }
     // init each page
-    for (int j = 0; j < this->FreePagesCount(); ++j)
+    for (uint64_t j = 0; j < pages_count; ++j)
     {
         pages[j].zone = this;
         pages[j].physical_address = (uint8_t *)(this->physical_start_address + PAGE_4K_SIZE * j);
         pages[j].attributes = 0;
         pages[j].reference_count = 0;
+        pages[j].desc = nullptr;
     }
 
-    auto reserved_page_count = (PAGE_4K_ROUND_UP((uint64_t)pages_end) - (uint64_t)Phy_To_Virt(pstart)) / PAGE_4K_SIZE;
+    // the zone itself and its metadata stay allocated
+    // unless they were placed outside of the region
+    uint64_t reserved_page_count = 0;
+    if ((uint64_t)Virt_To_Phy(this) == this->physical_start_address)
+        reserved_page_count = (PAGE_4K_ROUND_UP((uint64_t)pages_end) - (uint64_t)this) / PAGE_4K_SIZE;
     printk("reserving memory ...\n");
-    for (int i = 0; i < reserved_page_count; ++i)
-    {
-        this->AllocatePages(1);
-    }
+    this->buddy.Init(metadata, this->pages, pages_count, reserved_page_count);
+    this->free_pages_count = pages_count - reserved_page_count;
     printk("reserving memory done\n");
 }
 
 int64_t Zone::AllocatePages(uint64_t pages_count)
 {
     LockGuard<Spinlock> lg(this->lock);
-    assert(pages_count >= 1);
-
-    if (!IS_POWER_OF_2(pages_count))
-        pages_count = next_pow_of_2(pages_count);
-    unsigned index = 0;
-    // if the first(largest) doesn't fit return error
-    if (this->nodes[index] < pages_count)
+    auto offset = this->buddy.Allocate(pages_count);
+    if (offset == -1)
     {
-        printk("this->nodes[0] == %d < %d\n", this->nodes[0], pages_count);
+        printk("zone out of %d pages, %d free\n", pages_count, this->free_pages_count);
         return -1;
     }
 
-    auto node_size = this->total_pages_count_rounded_up;
-    for (; node_size != pages_count; node_size /= 2)
-    {
-        if (this->nodes[LEFT_LEAF(index)] >= pages_count)
-            index = LEFT_LEAF(index);
-        else
-            index = RIGHT_LEAF(index);
-    }
-    auto offset = (index + 1) * node_size - this->total_pages_count_rounded_up;
-    if (offset > this->total_pages_count)
-    {
-        return -1;
-    }
-
-    // 标记为已用
-    this->nodes[index] = 0;
+    this->free_pages_count -= next_pow_of_2(pages_count);
+    return offset;
+}
 
-    while (index)
+uint64_t Zone::AllocatePagesBatch(Page **pages, uint64_t count)
+{
+    LockGuard<Spinlock> lg(this->lock);
+    uint64_t allocated = 0;
+    for (; allocated < count; ++allocated)
     {
-        index = PARENT(index);
-        this->nodes[index] =
-            MAX(this->nodes[LEFT_LEAF(index)], this->nodes[RIGHT_LEAF(index)]);
+        auto offset = this->buddy.Allocate(1);
+        if (offset == -1)
+            break;
+        pages[allocated] = &this->pages[offset];
     }
+    this->free_pages_count -= allocated;
+    return allocated;
+}
 
-    return offset;
+void Zone::FreePagesBatch(Page **pages, uint64_t count)
+{
+    LockGuard<Spinlock> lg(this->lock);
+    for (uint64_t i = 0; i < count; ++i)
+        this->free_pages_count += this->buddy.Free(pages[i] - this->pages);
 }
+
 bool Zone::Reserve(uint64_t page_offset)
 {
     LockGuard<Spinlock> lg(this->lock);
-    if (page_offset > this->total_pages_count)
-        return true;
-    // make sure the branch is free
-    auto page_index = ((page_offset + this->total_pages_count_rounded_up) / 1) - 1;
-    auto index = page_index;
-    do
-    {
-        if (this->nodes[index] == 0)
-            return false;
-        index = PARENT(index);
-    } while (index > 0);
+    if (!this->buddy.Reserve(page_offset))
+        return false;
 
-    this->nodes[page_index] = 0;
+    if (page_offset < this->total_pages_count)
+        --this->free_pages_count;
     return true;
 }
 
 int64_t Zone::FreePages(uint64_t offset)
 {
     LockGuard<Spinlock> lg(this->lock);
-    unsigned node_size, index = 0;
-    unsigned left_longest, right_longest;
-
-    assert(offset >= 0 && offset < this->total_pages_count);
-
-    node_size = 1;
-    index = offset + this->total_pages_count - 1;
-
-    for (; this->nodes[index]; index = PARENT(index))
-    {
-        node_size *= 2;
-        if (index == 0)
-            return 0;
-    }
-
-    this->nodes[index] = node_size;
-
-    while (index)
-    {
-        index = PARENT(index);
-        node_size *= 2;
-
-        left_longest = this->nodes[LEFT_LEAF(index)];
-        right_longest = this->nodes[RIGHT_LEAF(index)];
-
-        if (left_longest + right_longest == node_size)
-            this->nodes[index] = node_size;
-        else
-            this->nodes[index] = MAX(left_longest, right_longest);
-    }
-    return 1;
+    auto freed = this->buddy.Free(offset);
+    this->free_pages_count += freed;
+    return freed;
 }
@@ -1,6 +1,7 @@
 #pragma once
 #include <std/stdint.h>
 #include "physical_page.h"
+#include "buddy.h"
 #include <std/spinlock.h>
 
 class multiboot_mmap_entry;
@@ -8,16 +9,20 @@ class multiboot_mmap_entry;
 class Zone
 {
 public:
-    Zone(uint8_t *pstart, uint8_t *pend);
+    Zone(uint8_t *pstart, uint8_t *pend, uint64_t attribute, uint32_t node);
+
+    // bytes needed by the zone and its metadata
+    static uint64_t MetadataSize(uint64_t page_count)
+    {
+        return sizeof(Zone) + BuddyEngine::MetadataSize(page_count) + sizeof(Page) * page_count;
+    }
 
     int64_t AllocatePages(uint64_t page_count);
     int64_t FreePages(uint64_t page_index);
+    // single pages for the cpu caches, one lock round trip for the whole batch
+    uint64_t AllocatePagesBatch(Page **pages, uint64_t count);
+    void FreePagesBatch(Page **pages, uint64_t count);
     bool Reserve(uint64_t page_index);
-    uint64_t BuddySystemSize()
-    {
-        // printk("total_pages_count %d\n", this->total_pages_count);
-        return this->total_pages_count * sizeof(uint64_t) + sizeof(Zone);
-    }
 
     uint64_t PageSize();
 
@@ -26,6 +31,33 @@ public:
         return this->pages;
     }
 
+    inline Page *PageOf(uint64_t physical_address)
+    {
+        if (physical_address < this->physical_start_address || physical_address >= this->physical_end_address)
+            return nullptr;
+        return &this->pages[(physical_address - this->physical_start_address) / PAGE_4K_SIZE];
+    }
+
+    inline uint64_t End()
+    {
+        return this->zone_end;
+    }
+
+    inline uint64_t PhysicalStart()
+    {
+        return this->physical_start_address;
+    }
+
+    inline uint64_t Attribute()
+    {
+        return this->attribute;
+    }
+
+    inline uint32_t Node()
+    {
+        return this->node;
+    }
+
     inline uint64_t FreePagesCount()
     {
         return this->free_pages_count;
@@ -42,14 +74,14 @@ private:
     Spinlock lock;
     uint64_t free_pages_count;
     uint64_t total_pages_count;
-    uint64_t total_pages_count_rounded_up;
 
     uint64_t physical_start_address;
     uint64_t physical_end_address;
     uint64_t attribute;
     uint64_t zone_end;
+    // proximity domain from the SRAT
+    uint32_t node;
 
-    uint32_t *nodes;
     Page *pages;
-
+    BuddyEngine buddy;
 };
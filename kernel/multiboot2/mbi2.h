@@ -3,6 +3,7 @@
 #include <std/stdint.h>
 #include <multiboot2.h>
 #include <memory/physical.h>
+#include <acpi/srat.h>
 #include <std/debug.h>
 
 #define MULTIBOOT_BOOTLOADER_NAME_SIZE 64
@@ -44,6 +45,10 @@ struct MBI2
             RSDP::GetInstance()->Init(2, (uint8_t *)&rsdp_tag->rsdp);
         }
 
+        // zones are split at node boundaries, so the SRAT goes first
+        if (acpi_old_tag_address || acpi_new_tag_address)
+            SRAT::GetInstance()->Init();
+
         if (mmap_tag_address)
         {
             auto tag = (multiboot_tag *)mmap_tag_address;
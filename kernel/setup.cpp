@@ -19,61 +19,9 @@ extern "C" char pde;
 
 extern char _kernel_virtual_end;
 
-static __attribute__((aligned(0x1000))) Page_PTE pte2_8[512 * 3];
-
-void do_1gb_mapping()
-{
-  auto pdpe_base = ((Page_PDPE *)&pdpe);
-  pdpe_base[0x1fd].P = 1;
-  pdpe_base[0x1fd].R_W = 1;
-  pdpe_base[0x1fd].SIZE = 1;
-  pdpe_base[0x1fd].NEXT = (0x40000000) >> PAGE_4K_SHIFT;
-
-  pdpe_base[0x1fe].P = 1;
-  pdpe_base[0x1fe].R_W = 1;
-  pdpe_base[0x1fe].SIZE = 1;
-  pdpe_base[0x1fe].NEXT = (0x80000000) >> PAGE_4K_SHIFT;
-
-  pdpe_base[0x1ff].P = 1;
-  pdpe_base[0x1ff].R_W = 1;
-  pdpe_base[0x1ff].SIZE = 1;
-  pdpe_base[0x1ff].NEXT = (0xc0000000) >> PAGE_4K_SHIFT;
-
-  flush_tlb();
-}
-
-void do_8mb_mapping()
-{
-
-  printk("pml4 at %p, pdpe at %p, pde at %p\n", &pml4, &pdpe, &pde);
-  auto pte_base = (Page_PTE *)(pte2_8);
-  // one pde can cover up to 1GB area
-  auto pde_base = (Page_PDE *)(Phy_To_Virt(&pde));
-  // from pte_base we are going to build 3 entire pte from 0xd000 to 0xffff
-  // each pte takes 0x1000 bytes
-  bzero(pte_base, 0x1000 * 3);
-  auto physical_base = 0x200000;
-  auto step = 0x1000;
-  for (int i = 1; i <= 3; ++i)
-  {
-    pde_base[i] = pde_base[0];
-    // must be physical address
-    pde_base[i].NEXT = uint64_t(Virt_To_Phy(pte_base)) >> 12;
-    for (int j = 0; j < 512; ++j)
-    {
-      pte_base[j].P = 1;
-      pte_base[j].R_W = 1;
-      pte_base[j].PPBA = (physical_base * i + j * step) >> 12;
-    }
-    // switch to next pte base
-    pte_base = (Page_PTE *)(uint64_t(pte_base) + 0x1000);
-  }
-}
-
 void basic_init(void *mbi_addr)
 {
-
-  do_1gb_mapping();
+  // everything below uses Phy_To_Virt
   vmap_init();
 
   // /* render one glyph for UNICODE code point 'A', directly to the screen and then adjust pen position */
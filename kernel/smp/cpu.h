@@ -10,6 +10,11 @@
 #include <thread/scheduler.h>
 #include <memory/lrmalloc/cache_bin.h>
 #include <std/msr.h>
+#include <acpi/srat.h>
+
+struct PageFrameCache;
+struct KmemMagazine;
+struct mm_struct;
 
 struct cpu_struct
 {
@@ -22,11 +27,19 @@ struct cpu_struct
 
     bool online;
     uint64_t apic_id;
+    uint32_t node;
     void *cpu_stack;
     tss_struct tss;
     gdt_struct gdt;
     Scheduler scheduler;
     TCacheBin *mcache;
+    PageFrameCache *pcp;
+    // one magazine per kmem_cache id
+    KmemMagazine *kmem_magazines;
+    // pcid generation the tlb of this cpu was last flushed for
+    uint64_t pcid_generation;
+    // address space loaded on this cpu, nullptr for the kernel pml4
+    mm_struct *volatile active_mm;
 };
 
 inline cpu_struct *get_this_cpu()
@@ -52,6 +65,7 @@ public:
         this->cpus.push_back(cpu_struct());
         auto cs = &this->cpus.back();
         cs->apic_id = id;
+        cs->node = SRAT::GetInstance()->NodeOfApic(id);
         cs->tss = tss_struct();
         cs->gdt = gdt_struct();
         cs->gdt.gdt_ptr.gdt_address = (uint8_t *)&cs->gdt.gdt_table;
@@ -60,6 +74,10 @@ public:
 
         cs->scheduler = Scheduler();
         cs->mcache = nullptr;
+        cs->pcp = nullptr;
+        cs->kmem_magazines = nullptr;
+        cs->pcid_generation = 0;
+        cs->active_mm = nullptr;
     }
 
     void Refresh() {
@@ -7,6 +7,9 @@
 #include <thread/task.h>
 #include <syscall.h>
 #include <std/interrupt.h>
+#include <memory/lrmalloc/lrmalloc.h>
+#include <memory/kmem_cache.h>
+#include <std/cpu_features.h>
 
 void cpu_local_struct_init()
 {
@@ -24,6 +27,10 @@ void SMP::Init()
     Syscall::GetInstance()->Init();
 
     cpu_local_struct_init();
+    PhysicalMemory::GetInstance()->InitCpuCache(this_cpu);
+    PhysicalMemory::GetInstance()->EnableCpuCache();
+    kmem_cache_cpu_init(this_cpu);
+    kmem_cache_enable_magazines();
 
     auto apic = APIC::GetInstance();
     // DSH: 0x3 all excluding self
@@ -40,6 +47,10 @@ void SMP::Init()
     for (int i = 1; i < cpus.size(); ++i)
     {
         auto &cpu = cpus[i];
+        // the ap may kmalloc as soon as it is online
+        lrmalloc_cpu_init(&cpu);
+        PhysicalMemory::GetInstance()->InitCpuCache(&cpu);
+        kmem_cache_cpu_init(&cpu);
         // DSH: 0x0 not broadcast
         // MT: 110b INIT
         // L: 1
@@ -69,6 +80,7 @@ void SMP::Init()
 
 extern "C" void smp_entry()
 {
+    // on the idle task stack now, the next ap may use the boot stack
     extern uint64_t smp_spin_lock;
     // smp_spin_lock must be 1 because you can't reach here unless you hold the lock
     smp_spin_lock = 0;
@@ -76,27 +88,31 @@ extern "C" void smp_entry()
     sti();
     while (1)
     {
+        // no tick wakes an idle cpu, fill the pool before sleeping
+        while (PhysicalMemory::GetInstance()->RefillZeroedPool())
+            ;
         hlt();
     }
 }
 
 extern "C" void smp_apu_init()
 {
+    // the bsp turned on pcids and the avx state
+    cpu_features_enable();
+    // page allocations go through this_cpu once the cpu caches are enabled
+    cpu_local_struct_init();
+
     GDT::GetInstance()->Init();
     IDT::GetInstance()->Init();
     Syscall::GetInstance()->Init();
     APIC::GetInstance()->Init();
 
-    cpu_local_struct_init();
-
-    auto &u = CPU::GetInstance()->Get();
     CPU::GetInstance()->SetOnline();
     printk("AP CPU %d online\n", CPU::GetInstance()->Get().apic_id);
 
-    asm volatile("movq %0, %%rsp \n\t"
-                 "movq %%rsp, %%rbp \n\t" ::"m"(u.syscall_struct.syscall_stack));
+    // smp_entry becomes the idle task, the ap runs what it steals
     //no return
-    asm volatile("jmp smp_entry");
+    task_init_ap(smp_entry);
 }
 
 extern "C" void smp_callback()
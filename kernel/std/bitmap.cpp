@@ -1,8 +1,46 @@
 #include "bitmap.h"
 #include "kstring.h"
 #include "math.h"
+#include "cpu_features.h"
 #include <memory/kmalloc.h>
 
+#define WORD_OF(offset) ((offset) / 64)
+#define BIT_OF(offset) ((offset) % 64)
+// bits [0, n) of a word, n in 0..64
+#define LOW_BITS(n) ((n) == 64 ? ~0UL : (1UL << (n)) - 1)
+
+static uint32_t popcount_swar(uint64_t word)
+{
+    word = word - ((word >> 1) & 0x5555555555555555UL);
+    word = (word & 0x3333333333333333UL) + ((word >> 2) & 0x3333333333333333UL);
+    word = (word + (word >> 4)) & 0x0f0f0f0f0f0f0f0fUL;
+    return (word * 0x0101010101010101UL) >> 56;
+}
+
+static uint32_t popcount_insn(uint64_t word)
+{
+    uint64_t count;
+    asm volatile("popcnt %1, %0"
+                 : "=r"(count)
+                 : "r"(word));
+    return count;
+}
+
+// the kernel is built for core2, popcnt is only used when the cpu has it
+static uint32_t (*popcount)(uint64_t) = nullptr;
+
+static uint32_t popcount_word(uint64_t word)
+{
+    if (!popcount)
+        popcount = cpu_has(CPU_FEATURE_POPCNT) ? popcount_insn : popcount_swar;
+    return popcount(word);
+}
+
+uint64_t Bitmap::AllocSize(uint32_t bitmap_size)
+{
+    return sizeof(Bitmap) + ROUND_UP_8BYTES((uint64_t)bitmap_size);
+}
+
 Bitmap::Bitmap(uint32_t bitmap_size)
 {
     this->bitmap_size = bitmap_size;
@@ -19,26 +57,106 @@ Bitmap::Bitmap(uint32_t bitmap_size, bool placement_new)
 
 void Bitmap::Set(uint32_t offset)
 {
-    auto idx = offset / 8;
-    auto mod = offset % 8;
-    SET_BIT(this->bitmap[idx], mod);
+    this->bitmap[WORD_OF(offset)] |= 1UL << BIT_OF(offset);
 }
 
 void Bitmap::UnSet(uint32_t offset)
 {
-    auto idx = offset / 8;
-    auto mod = offset % 8;
-    UNSET_BIT(this->bitmap[idx], mod);
+    this->bitmap[WORD_OF(offset)] &= ~(1UL << BIT_OF(offset));
 }
 
 bool Bitmap::IsSet(uint32_t offset)
 {
-    auto idx = offset / 8;
-    auto mod = offset % 8;
-    return CHECK_BIT(this->bitmap[idx], mod);
+    return this->bitmap[WORD_OF(offset)] & (1UL << BIT_OF(offset));
 }
 
 void Bitmap::Clear()
 {
-    bzero(this->bitmap, bitmap_size);
-}
\ No newline at end of file
+    bzero(this->bitmap, this->WordCount() * sizeof(uint64_t));
+}
+
+int64_t Bitmap::FindFirstZero()
+{
+    return this->FindNextZero(0);
+}
+
+int64_t Bitmap::FindFirstSet()
+{
+    return this->FindNextSet(0);
+}
+
+int64_t Bitmap::FindNextZero(uint32_t offset)
+{
+    if (offset >= this->bit_size)
+        return -1;
+
+    // bits below offset count as set so they're skipped
+    auto idx = WORD_OF(offset);
+    uint64_t word = ~(this->bitmap[idx] | LOW_BITS(BIT_OF(offset)));
+    while (!word)
+    {
+        if (++idx >= this->WordCount())
+            return -1;
+        word = ~this->bitmap[idx];
+    }
+
+    int64_t found = idx * 64 + __builtin_ctzl(word);
+    return found < this->bit_size ? found : -1;
+}
+
+int64_t Bitmap::FindNextSet(uint32_t offset)
+{
+    if (offset >= this->bit_size)
+        return -1;
+
+    auto idx = WORD_OF(offset);
+    uint64_t word = this->bitmap[idx] & ~LOW_BITS(BIT_OF(offset));
+    while (!word)
+    {
+        if (++idx >= this->WordCount())
+            return -1;
+        word = this->bitmap[idx];
+    }
+
+    int64_t found = idx * 64 + __builtin_ctzl(word);
+    return found < this->bit_size ? found : -1;
+}
+
+void Bitmap::SetRange(uint32_t offset, uint32_t count)
+{
+    while (count)
+    {
+        auto bit = BIT_OF(offset);
+        auto n = 64 - bit < count ? 64 - bit : count;
+        this->bitmap[WORD_OF(offset)] |= LOW_BITS(n) << bit;
+        offset += n;
+        count -= n;
+    }
+}
+
+void Bitmap::UnSetRange(uint32_t offset, uint32_t count)
+{
+    while (count)
+    {
+        auto bit = BIT_OF(offset);
+        auto n = 64 - bit < count ? 64 - bit : count;
+        this->bitmap[WORD_OF(offset)] &= ~(LOW_BITS(n) << bit);
+        offset += n;
+        count -= n;
+    }
+}
+
+uint32_t Bitmap::Count()
+{
+    uint32_t count = 0;
+    auto words = this->WordCount();
+    for (uint32_t idx = 0; idx < words; ++idx)
+    {
+        auto word = this->bitmap[idx];
+        // the tail of the last word isn't part of the bitmap
+        if (idx == words - 1 && BIT_OF(this->bit_size))
+            word &= LOW_BITS(BIT_OF(this->bit_size));
+        count += popcount_word(word);
+    }
+    return count;
+}
@@ -5,6 +5,9 @@
 class Bitmap
 {
 public:
+    // bytes needed to place a Bitmap of bitmap_size bytes, storage is rounded up to words
+    static uint64_t AllocSize(uint32_t bitmap_size);
+
     Bitmap(uint32_t bitmap_size);
     Bitmap(uint32_t bitmap_size, bool placement_new);
     void Set(uint32_t offset);
@@ -12,6 +15,17 @@ public:
     bool IsSet(uint32_t offset);
     void Clear();
 
+    // searches return the bit offset, -1 if there is none
+    int64_t FindFirstZero();
+    int64_t FindFirstSet();
+    int64_t FindNextZero(uint32_t offset);
+    int64_t FindNextSet(uint32_t offset);
+
+    void SetRange(uint32_t offset, uint32_t count);
+    void UnSetRange(uint32_t offset, uint32_t count);
+    // number of set bits
+    uint32_t Count();
+
     uint32_t Size() {
         return this->bitmap_size;
     }
@@ -21,9 +35,13 @@ public:
     }
 
 private:
+    uint32_t WordCount() {
+        return (this->bit_size + 63) / 64;
+    }
+
     // how many bits does bitmap have
     uint32_t bit_size;
     // how many bytes does bitmap have
     uint32_t bitmap_size;
-    uint8_t bitmap[];
-};
\ No newline at end of file
+    uint64_t bitmap[];
+};
@@ -0,0 +1,104 @@
+#include "cpu_features.h"
+#include "cpuid.h"
+#include "kstring.h"
+
+// cpuid 1 ecx
+#define CPUID_1_ECX_PCID (1U << 17)
+#define CPUID_1_ECX_SSE42 (1U << 20)
+#define CPUID_1_ECX_POPCNT (1U << 23)
+#define CPUID_1_ECX_TSC_DEADLINE (1U << 24)
+#define CPUID_1_ECX_XSAVE (1U << 26)
+#define CPUID_1_ECX_AVX (1U << 28)
+// cpuid 1 edx
+#define CPUID_1_EDX_SSE2 (1U << 26)
+// cpuid 7.0 ebx
+#define CPUID_7_EBX_AVX2 (1U << 5)
+#define CPUID_7_EBX_ERMS (1U << 9)
+// cpuid 0x80000001 edx
+#define CPUID_EXT_EDX_PAGE1GB (1U << 26)
+// cpuid 0x80000007 edx
+#define CPUID_POWER_EDX_INVARIANT_TSC (1U << 8)
+
+#define CR4_PCIDE (1UL << 17)
+#define CR4_OSXSAVE (1UL << 18)
+// x87, sse and the upper halves of the ymm registers
+#define XCR0_AVX_STATE 0x7
+
+static uint32_t features;
+static bool detected;
+
+static void detect()
+{
+    unsigned int a, b, c, d;
+    get_cpuid(0, 0, &a, &b, &c, &d);
+    auto max_leaf = a;
+
+    get_cpuid(1, 0, &a, &b, &c, &d);
+    if (d & CPUID_1_EDX_SSE2)
+        features |= CPU_FEATURE_SSE2;
+    if (c & CPUID_1_ECX_SSE42)
+        features |= CPU_FEATURE_SSE42;
+    if (c & CPUID_1_ECX_POPCNT)
+        features |= CPU_FEATURE_POPCNT;
+    if (c & CPUID_1_ECX_PCID)
+        features |= CPU_FEATURE_PCID;
+    if (c & CPUID_1_ECX_TSC_DEADLINE)
+        features |= CPU_FEATURE_TSC_DEADLINE;
+    bool avx = (c & CPUID_1_ECX_XSAVE) && (c & CPUID_1_ECX_AVX);
+
+    if (max_leaf >= 7)
+    {
+        get_cpuid(7, 0, &a, &b, &c, &d);
+        if (avx && (b & CPUID_7_EBX_AVX2))
+            features |= CPU_FEATURE_AVX2;
+        if (b & CPUID_7_EBX_ERMS)
+            features |= CPU_FEATURE_ERMS;
+    }
+
+    get_cpuid(0x80000000, 0, &a, &b, &c, &d);
+    auto max_ext_leaf = a;
+    if (max_ext_leaf >= 0x80000001)
+    {
+        get_cpuid(0x80000001, 0, &a, &b, &c, &d);
+        if (d & CPUID_EXT_EDX_PAGE1GB)
+            features |= CPU_FEATURE_PAGE1GB;
+    }
+    if (max_ext_leaf >= 0x80000007)
+    {
+        get_cpuid(0x80000007, 0, &a, &b, &c, &d);
+        if (d & CPUID_POWER_EDX_INVARIANT_TSC)
+            features |= CPU_FEATURE_INVARIANT_TSC;
+    }
+    detected = true;
+}
+
+void cpu_features_enable()
+{
+    uint64_t cr4;
+    asm volatile("movq %%cr4, %0"
+                 : "=r"(cr4));
+    if (features & CPU_FEATURE_AVX2)
+        cr4 |= CR4_OSXSAVE;
+    // needs cr3 to be on pcid 0, the boot pml4 is
+    if (features & CPU_FEATURE_PCID)
+        cr4 |= CR4_PCIDE;
+    asm volatile("movq %0, %%cr4" ::"r"(cr4));
+
+    if (features & CPU_FEATURE_AVX2)
+        asm volatile("xsetbv" ::"c"(0), "a"(XCR0_AVX_STATE), "d"(0));
+}
+
+void cpu_features_init()
+{
+    detect();
+    cpu_features_enable();
+    kstring_init();
+}
+
+bool cpu_has(uint32_t feature)
+{
+    // callers may run before cpu_features_init
+    if (!detected)
+        detect();
+    return (features & feature) == feature;
+}
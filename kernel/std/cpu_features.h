@@ -0,0 +1,28 @@
+#pragma once
+#include <std/stdint.h>
+
+// features the kernel picks code paths for
+enum CpuFeature
+{
+    CPU_FEATURE_SSE2 = 1 << 0,
+    CPU_FEATURE_SSE42 = 1 << 1,
+    CPU_FEATURE_POPCNT = 1 << 2,
+    // usable means cpuid has it and the kernel turned on its state in xcr0
+    CPU_FEATURE_AVX2 = 1 << 3,
+    // fast rep movsb/stosb
+    CPU_FEATURE_ERMS = 1 << 4,
+    CPU_FEATURE_PAGE1GB = 1 << 5,
+    // process context identifiers, cr4.pcide is on when set
+    CPU_FEATURE_PCID = 1 << 6,
+    // the lapic timer fires when the tsc reaches IA32_TSC_DEADLINE
+    CPU_FEATURE_TSC_DEADLINE = 1 << 7,
+    // the tsc ticks at a constant rate in every p and c state
+    CPU_FEATURE_INVARIANT_TSC = 1 << 8,
+};
+
+// detect on the bsp, enable the extended state and pick the string routines
+void cpu_features_init();
+// every ap turns on what the bsp decided to use before it runs any other code
+// that is the avx state and pcids
+void cpu_features_enable();
+bool cpu_has(uint32_t feature);
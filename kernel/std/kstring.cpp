@@ -1,14 +1,188 @@
 #include "kstring.h"
 #include <std/stdint.h>
 
-void memcpy(void *dst, const void *src, uint64_t len)
+#include <std/cpu_features.h>
+
+// unaligned word access that may alias anything
+typedef uint64_t __attribute__((may_alias, aligned(1))) uword_t;
+
+// below this the indirect call costs more than the vector loop saves
+#define KSTRING_VECTOR_MIN 64
+
+void memcpy_generic(void *dst, const void *src, uint64_t len)
 {
     uint8_t *cdst = (uint8_t *)dst;
     uint8_t *csrc = (uint8_t *)src;
+    for (; len >= 8; len -= 8, cdst += 8, csrc += 8)
+        *(uword_t *)cdst = *(const uword_t *)csrc;
     for (; len != 0; len--)
-    {
         *cdst++ = *csrc++;
+}
+
+void memcpy_erms(void *dst, const void *src, uint64_t len)
+{
+    asm volatile("rep movsb"
+                 : "+D"(dst), "+S"(src), "+c"(len)
+                 :
+                 : "memory");
+}
+
+void memcpy_sse2(void *dst, const void *src, uint64_t len)
+{
+    uint8_t *cdst = (uint8_t *)dst;
+    uint8_t *csrc = (uint8_t *)src;
+    if (len >= 64)
+    {
+        asm volatile("1:\n\t"
+                     "movdqu (%[s]), %%xmm0\n\t"
+                     "movdqu 16(%[s]), %%xmm1\n\t"
+                     "movdqu 32(%[s]), %%xmm2\n\t"
+                     "movdqu 48(%[s]), %%xmm3\n\t"
+                     "movdqu %%xmm0, (%[d])\n\t"
+                     "movdqu %%xmm1, 16(%[d])\n\t"
+                     "movdqu %%xmm2, 32(%[d])\n\t"
+                     "movdqu %%xmm3, 48(%[d])\n\t"
+                     "add $64, %[s]\n\t"
+                     "add $64, %[d]\n\t"
+                     "sub $64, %[n]\n\t"
+                     "cmp $64, %[n]\n\t"
+                     "jae 1b\n\t"
+                     : [d] "+r"(cdst), [s] "+r"(csrc), [n] "+r"(len)
+                     :
+                     : "xmm0", "xmm1", "xmm2", "xmm3", "memory", "cc");
+    }
+    memcpy_generic(cdst, csrc, len);
+}
+
+void memcpy_avx2(void *dst, const void *src, uint64_t len)
+{
+    uint8_t *cdst = (uint8_t *)dst;
+    uint8_t *csrc = (uint8_t *)src;
+    if (len >= 128)
+    {
+        asm volatile("1:\n\t"
+                     "vmovdqu (%[s]), %%ymm0\n\t"
+                     "vmovdqu 32(%[s]), %%ymm1\n\t"
+                     "vmovdqu 64(%[s]), %%ymm2\n\t"
+                     "vmovdqu 96(%[s]), %%ymm3\n\t"
+                     "vmovdqu %%ymm0, (%[d])\n\t"
+                     "vmovdqu %%ymm1, 32(%[d])\n\t"
+                     "vmovdqu %%ymm2, 64(%[d])\n\t"
+                     "vmovdqu %%ymm3, 96(%[d])\n\t"
+                     "add $128, %[s]\n\t"
+                     "add $128, %[d]\n\t"
+                     "sub $128, %[n]\n\t"
+                     "cmp $128, %[n]\n\t"
+                     "jae 1b\n\t"
+                     // avoid the sse transition penalty in the code after us
+                     "vzeroupper\n\t"
+                     : [d] "+r"(cdst), [s] "+r"(csrc), [n] "+r"(len)
+                     :
+                     : "xmm0", "xmm1", "xmm2", "xmm3", "memory", "cc");
+    }
+    memcpy_sse2(cdst, csrc, len);
+}
+
+void memset_generic(void *dst, uint8_t val, uint64_t len)
+{
+    uint8_t *cdst = (uint8_t *)dst;
+    uint64_t pattern = val * 0x0101010101010101UL;
+    for (; len >= 8; len -= 8, cdst += 8)
+        *(uword_t *)cdst = pattern;
+    for (; len != 0; len--)
+        *cdst++ = val;
+}
+
+void memset_erms(void *dst, uint8_t val, uint64_t len)
+{
+    asm volatile("rep stosb"
+                 : "+D"(dst), "+c"(len)
+                 : "a"(val)
+                 : "memory");
+}
+
+void memset_sse2(void *dst, uint8_t val, uint64_t len)
+{
+    uint8_t *cdst = (uint8_t *)dst;
+    uint64_t pattern = val * 0x0101010101010101UL;
+    if (len >= 64)
+    {
+        asm volatile("movq %[p], %%xmm0\n\t"
+                     "punpcklqdq %%xmm0, %%xmm0\n\t"
+                     "1:\n\t"
+                     "movdqu %%xmm0, (%[d])\n\t"
+                     "movdqu %%xmm0, 16(%[d])\n\t"
+                     "movdqu %%xmm0, 32(%[d])\n\t"
+                     "movdqu %%xmm0, 48(%[d])\n\t"
+                     "add $64, %[d]\n\t"
+                     "sub $64, %[n]\n\t"
+                     "cmp $64, %[n]\n\t"
+                     "jae 1b\n\t"
+                     : [d] "+r"(cdst), [n] "+r"(len)
+                     : [p] "r"(pattern)
+                     : "xmm0", "memory", "cc");
     }
+    memset_generic(cdst, val, len);
+}
+
+void memset_avx2(void *dst, uint8_t val, uint64_t len)
+{
+    uint8_t *cdst = (uint8_t *)dst;
+    uint64_t pattern = val * 0x0101010101010101UL;
+    if (len >= 128)
+    {
+        asm volatile("vmovq %[p], %%xmm0\n\t"
+                     "vpbroadcastq %%xmm0, %%ymm0\n\t"
+                     "1:\n\t"
+                     "vmovdqu %%ymm0, (%[d])\n\t"
+                     "vmovdqu %%ymm0, 32(%[d])\n\t"
+                     "vmovdqu %%ymm0, 64(%[d])\n\t"
+                     "vmovdqu %%ymm0, 96(%[d])\n\t"
+                     "add $128, %[d]\n\t"
+                     "sub $128, %[n]\n\t"
+                     "cmp $128, %[n]\n\t"
+                     "jae 1b\n\t"
+                     "vzeroupper\n\t"
+                     : [d] "+r"(cdst), [n] "+r"(len)
+                     : [p] "r"(pattern)
+                     : "xmm0", "memory", "cc");
+    }
+    memset_sse2(cdst, val, len);
+}
+
+void bzero_nt(void *dst, uint64_t len)
+{
+    if (len == 0)
+        return;
+    asm volatile("xor %%eax, %%eax\n\t"
+                 "1:\n\t"
+                 "movnti %%rax, (%[d])\n\t"
+                 "movnti %%rax, 8(%[d])\n\t"
+                 "movnti %%rax, 16(%[d])\n\t"
+                 "movnti %%rax, 24(%[d])\n\t"
+                 "movnti %%rax, 32(%[d])\n\t"
+                 "movnti %%rax, 40(%[d])\n\t"
+                 "movnti %%rax, 48(%[d])\n\t"
+                 "movnti %%rax, 56(%[d])\n\t"
+                 "add $64, %[d]\n\t"
+                 "sub $64, %[n]\n\t"
+                 "jnz 1b\n\t"
+                 // order the weakly ordered stores before anyone sees the memory
+                 "sfence\n\t"
+                 : [d] "+r"(dst), [n] "+r"(len)
+                 :
+                 : "rax", "memory", "cc");
+}
+
+// generic until kstring_init has seen the cpu
+static memcpy_fn memcpy_impl = memcpy_generic;
+static memset_fn memset_impl = memset_generic;
+
+void memcpy(void *dst, const void *src, uint64_t len)
+{
+    if (len < KSTRING_VECTOR_MIN)
+        return memcpy_generic(dst, src, len);
+    memcpy_impl(dst, src, len);
 }
 
 void memmove(void *dst, const void *src, uint64_t len)
@@ -17,23 +191,24 @@ void memmove(void *dst, const void *src, uint64_t len)
     uint8_t *csrc = (uint8_t *)src;
     if (cdst > csrc && cdst < csrc + len)
     {
-        uint8_t *right_d_start = cdst + len - 1;
-        uint8_t *right_s_start = csrc + len - 1;
-        for (int i = 0; i < len; ++i)
+        // copy from the end so the source is read before it is overwritten
+        cdst += len;
+        csrc += len;
+        for (; len >= 8; len -= 8)
         {
-            *(right_d_start - i) = *(right_s_start - i);
+            cdst -= 8;
+            csrc -= 8;
+            *(uword_t *)cdst = *(const uword_t *)csrc;
         }
+        for (; len != 0; len--)
+            *--cdst = *--csrc;
         return;
     }
 
     if (csrc > cdst && csrc < cdst + len)
     {
-        uint8_t *left_d_start = cdst;
-        uint8_t *left_s_start = csrc;
-        for (int i = 0; i < len; ++i)
-        {
-            *(left_d_start + i) = *(left_s_start + i);
-        }
+        // a forward word copy reads each word before it can be overwritten
+        memcpy_generic(dst, src, len);
         return;
     }
 
@@ -42,11 +217,9 @@ void memmove(void *dst, const void *src, uint64_t len)
 
 void memset(void *dst, uint8_t val, uint64_t len)
 {
-    uint8_t *cdst = (uint8_t *)dst;
-    for (; len != 0; len--)
-    {
-        *cdst++ = val;
-    }
+    if (len < KSTRING_VECTOR_MIN)
+        return memset_generic(dst, val, len);
+    memset_impl(dst, val, len);
 }
 
 void bzero(void *dest, uint64_t len)
@@ -78,35 +251,108 @@ void hzero(void *dest, uint64_t len)
     }
 }
 
-int strcmp(const char *s1, const char *s2)
+// a word may be read past the end of a string as long as it stays on the same page
+#define KSTRING_PAGE_SIZE 4096
+#define CROSSES_PAGE(ptr, size) ((((uint64_t)(ptr)) & (KSTRING_PAGE_SIZE - 1)) > KSTRING_PAGE_SIZE - (size))
+// nonzero when a byte of x is zero, the lowest set bit marks the first one
+#define HAS_ZERO_BYTE(x) (((x)-0x0101010101010101UL) & ~(x)&0x8080808080808080UL)
+
+// the order of strcmp in this kernel, > 0 when s2 sorts after s1
+static int byte_order(uint8_t c1, uint8_t c2)
+{
+    if (c2 > c1)
+        return 1;
+    if (c2 < c1)
+        return -1;
+    return 0;
+}
+
+static int strcmp_generic(const char *s1, const char *s2)
 {
-    int8_t res = 0;
-    while (!(res = *(uint8_t *)s2 - *(uint8_t *)s1) && *s1 != '\0')
+    // whole words while neither pointer can step onto an unmapped page
+    while (!CROSSES_PAGE(s1, 8) && !CROSSES_PAGE(s2, 8))
+    {
+        uint64_t w1 = *(const uword_t *)s1;
+        uint64_t w2 = *(const uword_t *)s2;
+        if (w1 != w2 || HAS_ZERO_BYTE(w1))
+            break;
+        s1 += 8;
+        s2 += 8;
+    }
+
+    // the rest ends within a word, or walks over the page boundary
+    while (*s1 && *s1 == *s2)
     {
         ++s1;
         ++s2;
     }
-    if (res < 0)
-        res = -1;
-    else if (res > 0)
-        res = 1;
-    return res;
+    return byte_order(*s1, *s2);
+}
+
+static int strlen_generic(const char *src)
+{
+    const char *eos = src;
+    while ((uint64_t)eos & 7)
+    {
+        if (!*eos)
+            return eos - src;
+        ++eos;
+    }
+
+    // aligned words never cross a page
+    uint64_t zero;
+    while (!(zero = HAS_ZERO_BYTE(*(const uint64_t *)eos)))
+        eos += 8;
+    return eos - src + __builtin_ctzl(zero) / 8;
+}
+
+int strcmp(const char *s1, const char *s2)
+{
+    return strcmp_generic(s1, s2);
 }
 
 int strncmp(const char *s1, const char *s2, int n)
 {
-    int8_t res = 0;
-    while (n > 0 && *s1 && !(res = *(uint8_t *)s2 - *(uint8_t *)s1))
+    while (n >= 8 && !CROSSES_PAGE(s1, 8) && !CROSSES_PAGE(s2, 8))
     {
-        ++s1;
-        ++s2;
-        --n;
+        uint64_t w1 = *(const uword_t *)s1;
+        uint64_t w2 = *(const uword_t *)s2;
+        if (w1 != w2 || HAS_ZERO_BYTE(w1))
+            break;
+        s1 += 8;
+        s2 += 8;
+        n -= 8;
+    }
+
+    for (; n > 0; --n, ++s1, ++s2)
+    {
+        if (!*s1 || *s1 != *s2)
+            return byte_order(*s1, *s2);
     }
-    if (res < 0)
-        res = -1;
-    else if (res > 0)
-        res = 1;
-    return res;
+    return 0;
+}
+
+int memcmp(const void *s1, const void *s2, uint64_t len)
+{
+    auto c1 = (const uint8_t *)s1;
+    auto c2 = (const uint8_t *)s2;
+    for (; len >= 8; len -= 8, c1 += 8, c2 += 8)
+    {
+        uint64_t diff = *(const uword_t *)c1 ^ *(const uword_t *)c2;
+        if (diff)
+        {
+            // little endian, the lowest differing bit is in the first differing byte
+            auto index = __builtin_ctzl(diff) / 8;
+            return byte_order(c1[index], c2[index]);
+        }
+    }
+
+    for (; len != 0; --len, ++c1, ++c2)
+    {
+        if (*c1 != *c2)
+            return byte_order(*c1, *c2);
+    }
+    return 0;
 }
 
 char *strcpy(char *dst, const char *src)
@@ -154,10 +400,16 @@ char *strcat(char *dest, const char *src)
 
 int strlen(const char *src)
 {
-    const char *eos = src;
-
-    while (*eos++)
-        ;
+    return strlen_generic(src);
+}
 
-    return (eos - src - 1);
-}
\ No newline at end of file
+void kstring_init()
+{
+    // no task saves the vector registers, the sse2 and avx2 variants would
+    // clobber them for whoever they preempt, rep movsb needs none
+    if (cpu_has(CPU_FEATURE_ERMS))
+    {
+        memcpy_impl = memcpy_erms;
+        memset_impl = memset_erms;
+    }
+}
@@ -27,4 +27,30 @@ extern "C"
     char *strcat(char *dest, const char *src);
 
     int strlen(const char *src);
+
+    // same order as strcmp
+    int memcmp(const void *s1, const void *s2, uint64_t len);
+
+    // zero with non-temporal stores, for memory that won't be read soon
+    // dest and len must be 64 byte aligned
+    void bzero_nt(void *dest, uint64_t len);
 }
+
+typedef void (*memcpy_fn)(void *dest, const void *src, uint64_t len);
+typedef void (*memset_fn)(void *dest, uint8_t val, uint64_t len);
+
+// pick memcpy and memset for this cpu, called from cpu_features_init
+void kstring_init();
+
+// the variants behind memcpy and memset, the sse2 ones are always there on x86_64
+// avx2 needs its state enabled by cpu_features_init
+// sse2 and avx2 use xmm0-3/ymm0-3 which nothing saves on a switch, only the
+// benchmark calls them, with preemption off
+void memcpy_generic(void *dest, const void *src, uint64_t len);
+void memcpy_erms(void *dest, const void *src, uint64_t len);
+void memcpy_sse2(void *dest, const void *src, uint64_t len);
+void memcpy_avx2(void *dest, const void *src, uint64_t len);
+void memset_generic(void *dest, uint8_t val, uint64_t len);
+void memset_erms(void *dest, uint8_t val, uint64_t len);
+void memset_sse2(void *dest, uint8_t val, uint64_t len);
+void memset_avx2(void *dest, uint8_t val, uint64_t len);
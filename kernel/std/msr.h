@@ -12,6 +12,7 @@
 #define MSR_TSC_AUX 0xc0000103        /* Auxiliary TSC */
 
 #define IA32_APIC_BASE 0x0000001b
+#define IA32_TSC_DEADLINE 0x000006e0
 
 #define APIC_ID 0x20 / 4
 #define APIC_VERSION 0x30 / 4
@@ -31,6 +32,7 @@
 #define APIC_TIMER_DCR 0x3e0 / 4
 #define APIC_TIMER_PERIODIC 0x00020000
 #define APIC_TIMER_ONE_SHOT 0x00000000
+#define APIC_TIMER_TSC_DEADLINE 0x00040000
 
 inline void wrmsr(unsigned long address, unsigned long value)
 {
@@ -47,4 +49,14 @@ inline uint64_t rdmsr(uint64_t address)
                  : "c"(address)
                  : "memory");
     return tmp0 << 32 | tmp1;
-}
\ No newline at end of file
+}
+inline uint64_t rdtsc()
+{
+    uint64_t tmp0 = 0;
+    uint64_t tmp1 = 0;
+    asm volatile("rdtsc	\n\t"
+                 : "=d"(tmp0), "=a"(tmp1)
+                 :
+                 : "memory");
+    return tmp0 << 32 | tmp1;
+}
@@ -0,0 +1,224 @@
+#include "rb_tree.h"
+
+static bool is_red(RBNode *node)
+{
+    return node && node->red;
+}
+
+void RBTree::rotate_left(RBNode *x)
+{
+    auto y = x->right;
+    x->right = y->left;
+    if (y->left)
+        y->left->parent = x;
+    this->transplant(x, y);
+    y->left = x;
+    x->parent = y;
+}
+
+void RBTree::rotate_right(RBNode *x)
+{
+    auto y = x->left;
+    x->left = y->right;
+    if (y->right)
+        y->right->parent = x;
+    this->transplant(x, y);
+    y->right = x;
+    x->parent = y;
+}
+
+void RBTree::transplant(RBNode *u, RBNode *v)
+{
+    if (!u->parent)
+        this->root = v;
+    else if (u == u->parent->left)
+        u->parent->left = v;
+    else
+        u->parent->right = v;
+    if (v)
+        v->parent = u->parent;
+}
+
+void RBTree::insert_fixup(RBNode *node)
+{
+    // the parent is red so it is not the root, the grandparent exists
+    while (is_red(node->parent))
+    {
+        auto parent = node->parent;
+        auto grandparent = parent->parent;
+        if (parent == grandparent->left)
+        {
+            auto uncle = grandparent->right;
+            if (is_red(uncle))
+            {
+                parent->red = false;
+                uncle->red = false;
+                grandparent->red = true;
+                node = grandparent;
+                continue;
+            }
+            if (node == parent->right)
+            {
+                node = parent;
+                this->rotate_left(node);
+                parent = node->parent;
+            }
+            parent->red = false;
+            grandparent->red = true;
+            this->rotate_right(grandparent);
+        }
+        else
+        {
+            auto uncle = grandparent->left;
+            if (is_red(uncle))
+            {
+                parent->red = false;
+                uncle->red = false;
+                grandparent->red = true;
+                node = grandparent;
+                continue;
+            }
+            if (node == parent->left)
+            {
+                node = parent;
+                this->rotate_right(node);
+                parent = node->parent;
+            }
+            parent->red = false;
+            grandparent->red = true;
+            this->rotate_left(grandparent);
+        }
+    }
+    this->root->red = false;
+}
+
+void RBTree::erase(RBNode *node)
+{
+    if (this->leftmost == node)
+        this->leftmost = next(node);
+
+    RBNode *x;
+    RBNode *x_parent;
+    bool removed_red = node->red;
+    if (!node->left)
+    {
+        x = node->right;
+        x_parent = node->parent;
+        this->transplant(node, node->right);
+    }
+    else if (!node->right)
+    {
+        x = node->left;
+        x_parent = node->parent;
+        this->transplant(node, node->left);
+    }
+    else
+    {
+        // the successor takes the place and the color of node
+        auto successor = node->right;
+        while (successor->left)
+            successor = successor->left;
+        removed_red = successor->red;
+        x = successor->right;
+        if (successor->parent == node)
+        {
+            x_parent = successor;
+        }
+        else
+        {
+            x_parent = successor->parent;
+            this->transplant(successor, successor->right);
+            successor->right = node->right;
+            successor->right->parent = successor;
+        }
+        this->transplant(node, successor);
+        successor->left = node->left;
+        successor->left->parent = successor;
+        successor->red = node->red;
+    }
+
+    if (!removed_red)
+        this->erase_fixup(x, x_parent);
+}
+
+void RBTree::erase_fixup(RBNode *x, RBNode *parent)
+{
+    while (x != this->root && !is_red(x))
+    {
+        if (x == parent->left)
+        {
+            auto sibling = parent->right;
+            if (is_red(sibling))
+            {
+                sibling->red = false;
+                parent->red = true;
+                this->rotate_left(parent);
+                sibling = parent->right;
+            }
+            if (!is_red(sibling->left) && !is_red(sibling->right))
+            {
+                sibling->red = true;
+                x = parent;
+                parent = x->parent;
+                continue;
+            }
+            if (!is_red(sibling->right))
+            {
+                sibling->left->red = false;
+                sibling->red = true;
+                this->rotate_right(sibling);
+                sibling = parent->right;
+            }
+            sibling->red = parent->red;
+            parent->red = false;
+            sibling->right->red = false;
+            this->rotate_left(parent);
+        }
+        else
+        {
+            auto sibling = parent->left;
+            if (is_red(sibling))
+            {
+                sibling->red = false;
+                parent->red = true;
+                this->rotate_right(parent);
+                sibling = parent->left;
+            }
+            if (!is_red(sibling->left) && !is_red(sibling->right))
+            {
+                sibling->red = true;
+                x = parent;
+                parent = x->parent;
+                continue;
+            }
+            if (!is_red(sibling->left))
+            {
+                sibling->right->red = false;
+                sibling->red = true;
+                this->rotate_left(sibling);
+                sibling = parent->left;
+            }
+            sibling->red = parent->red;
+            parent->red = false;
+            sibling->left->red = false;
+            this->rotate_right(parent);
+        }
+        x = this->root;
+    }
+    if (x)
+        x->red = false;
+}
+
+RBNode *RBTree::next(RBNode *node)
+{
+    if (node->right)
+    {
+        node = node->right;
+        while (node->left)
+            node = node->left;
+        return node;
+    }
+    while (node->parent && node == node->parent->right)
+        node = node->parent;
+    return node->parent;
+}
@@ -0,0 +1,76 @@
+#pragma once
+
+#include <std/stdint.h>
+
+// embedded in the element, find the element with container_of
+struct RBNode
+{
+    RBNode *parent;
+    RBNode *left;
+    RBNode *right;
+    bool red;
+};
+
+// intrusive red-black tree, it never allocates so it works with interrupts off
+class RBTree
+{
+public:
+    // less(a, b) orders the nodes, a node equal to others goes after them
+    template <typename Less>
+    void insert(RBNode *node, Less less)
+    {
+        RBNode *parent = nullptr;
+        auto link = &this->root;
+        bool is_leftmost = true;
+        while (*link)
+        {
+            parent = *link;
+            if (less(node, parent))
+            {
+                link = &parent->left;
+            }
+            else
+            {
+                link = &parent->right;
+                is_leftmost = false;
+            }
+        }
+
+        node->parent = parent;
+        node->left = nullptr;
+        node->right = nullptr;
+        node->red = true;
+        *link = node;
+        if (is_leftmost)
+            this->leftmost = node;
+        this->insert_fixup(node);
+    }
+
+    void erase(RBNode *node);
+
+    // smallest node, nullptr if empty
+    RBNode *first()
+    {
+        return this->leftmost;
+    }
+
+    static RBNode *next(RBNode *node);
+
+    bool empty()
+    {
+        return this->root == nullptr;
+    }
+
+private:
+    void rotate_left(RBNode *x);
+    void rotate_right(RBNode *x);
+    // put v where u is in the parent of u
+    void transplant(RBNode *u, RBNode *v);
+    void insert_fixup(RBNode *node);
+    // x took the place of a black node, x may be nullptr so its parent is passed
+    void erase_fixup(RBNode *x, RBNode *parent);
+
+    RBNode *root = nullptr;
+    // cached, the scheduler asks for it on every pick
+    RBNode *leftmost = nullptr;
+};
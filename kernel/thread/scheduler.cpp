@@ -1,20 +1,255 @@
+
 #include "scheduler.h"
 #include <std/printk.h>
+#include <time/ktime.h>
+#include <smp/cpu.h>
+#include <interrupt/apic.h>
+#include <interrupt/idt.h>
 
-extern task_struct *init_task;
+// 1024 * 1.25^priority
+static const uint64_t sched_weights[SCHED_PRIORITY_MAX + 1] = {
+    1024, 1280, 1600, 2000, 2500, 3125, 3906, 4883, 6104, 7629,
+    9537, 11921, 14901, 18626, 23283, 29104, 36380, 45475, 56843, 71054,
+};
 
-void Scheduler::Schedule()
+static uint64_t sched_weight(task_struct *task)
+{
+    return sched_weights[task->priority > SCHED_PRIORITY_MAX ? SCHED_PRIORITY_MAX : task->priority];
+}
+
+static bool vruntime_less(RBNode *a, RBNode *b)
+{
+    return container_of(a, task_struct, run_node)->vruntime < container_of(b, task_struct, run_node)->vruntime;
+}
+
+static uint64_t rt_level(task_struct *task)
+{
+    return task->priority > SCHED_RT_PRIORITY_MAX ? SCHED_RT_PRIORITY_MAX : task->priority;
+}
+
+void Scheduler::Init(task_struct *idle)
 {
-    if (this->next_task == nullptr)
+    this->nr_waiting = 0;
+    this->min_vruntime = 0;
+    this->rt_bitmap = 0;
+    for (auto &queue : this->rt_queues)
+        list_init(&queue);
+    this->cpu = this_cpu->apic_id;
+    this->timer_armed = false;
+    idle->cpu = this->cpu;
+    idle->on_cpu = true;
+    this->idle = idle;
+    this->running = idle;
+}
+
+void Scheduler::Kick()
+{
+    if (this->cpu == this_cpu->apic_id)
+    {
+        // fires as soon as interrupts are back on
+        APIC::GetInstance()->TimerArm(0);
         return;
+    }
+    APIC::GetInstance()->SendIPI(this->cpu, IPI_RESCHEDULE);
+}
 
-    auto next = this->next_task;
-    this->next_task = (task_struct *)list_next(&next->list);
-    // next == current only when idle task is running
-    if (next == current)
+void Scheduler::KickIdle()
+{
+    auto &cpus = CPU::GetInstance()->GetAll();
+    for (int i = 0; i < cpus.size(); ++i)
+    {
+        auto other = &cpus[i].scheduler;
+        if (other == this || !other->idle || other->running != other->idle || other->need_resched)
+            continue;
+        other->need_resched = true;
+        other->Kick();
         return;
-    // printk("from %d to %d\n", current->pid, next->pid);
+    }
+}
+
+// irq_handler calls Schedule when the sender set need_resched
+void reschedule_ipi_handler(uint64_t error_code, uint64_t rsp, uint64_t rflags, uint64_t rip)
+{
+}
+
+void Scheduler::Enqueue(task_struct *task)
+{
+    if (task->policy == SCHED_RT)
+    {
+        auto level = rt_level(task);
+        // behind the tasks of the same priority, they take turns
+        list_add_to_before(&this->rt_queues[level], &task->list);
+        this->rt_bitmap |= 1UL << level;
+    }
+    else
+    {
+        this->runqueue.insert(&task->run_node, vruntime_less);
+    }
+    task->on_rq = true;
+    this->nr_waiting = this->nr_waiting + 1;
+}
+
+void Scheduler::Unlink(task_struct *task)
+{
+    if (task->policy == SCHED_RT)
+    {
+        auto level = rt_level(task);
+        list_del(&task->list);
+        if (list_is_empty(&this->rt_queues[level]))
+            this->rt_bitmap &= ~(1UL << level);
+    }
+    else
+    {
+        this->runqueue.erase(&task->run_node);
+    }
+    task->on_rq = false;
+    this->nr_waiting = this->nr_waiting - 1;
+}
+
+task_struct *Scheduler::Dequeue()
+{
+    task_struct *task = nullptr;
+    if (this->rt_bitmap)
+    {
+        // bsf, the lowest set bit is the most urgent level
+        auto level = __builtin_ctzl(this->rt_bitmap);
+        task = container_of(list_next(&this->rt_queues[level]), task_struct, list);
+    }
+    else if (this->runqueue.first())
+    {
+        task = container_of(this->runqueue.first(), task_struct, run_node);
+    }
+
+    if (task)
+        this->Unlink(task);
+    return task;
+}
+
+bool Scheduler::Preempts(task_struct *task, task_struct *running)
+{
+    if (running == this->idle)
+        return true;
+    if (task->policy != running->policy)
+        return task->policy == SCHED_RT;
+    if (task->policy == SCHED_RT)
+        return rt_level(task) < rt_level(running);
+    return task->vruntime < running->vruntime;
+}
+
+void Scheduler::Account(task_struct *task, uint64_t now)
+{
+    // rt tasks don't share by weight, only fair ones keep a vruntime
+    if (task->policy == SCHED_FAIR)
+        task->vruntime += (now - task->exec_start) * SCHED_WEIGHT_DEFAULT / sched_weight(task);
+    task->exec_start = now;
+}
+
+task_struct *Scheduler::Steal()
+{
+    // the longest runqueue gains the most from losing a task
+    Scheduler *victim = nullptr;
+    uint64_t most = 0;
+    auto &cpus = CPU::GetInstance()->GetAll();
+    for (int i = 0; i < cpus.size(); ++i)
+    {
+        auto other = &cpus[i].scheduler;
+        if (other != this && other->Waiting() > most)
+        {
+            victim = other;
+            most = other->Waiting();
+        }
+    }
+    if (!victim)
+        return nullptr;
+
+    task_struct *task = nullptr;
+    victim->lock.lock();
+    // rt tasks first, then the most entitled fair task, it runs right away instead of soon
+    for (auto level = 0; level < SCHED_RT_LEVELS && !task; ++level)
+    {
+        if (!(victim->rt_bitmap & (1UL << level)))
+            continue;
+        auto &queue = victim->rt_queues[level];
+        for (auto node = list_next(&queue); node != &queue; node = list_next(node))
+        {
+            auto candidate = container_of(node, task_struct, list);
+            // woken before its cpu switched away from it
+            if (candidate->on_cpu)
+                continue;
+            task = candidate;
+            break;
+        }
+    }
+    for (auto node = victim->runqueue.first(); node && !task; node = RBTree::next(node))
+    {
+        auto candidate = container_of(node, task_struct, run_node);
+        if (candidate->on_cpu)
+            continue;
+        task = candidate;
+        break;
+    }
+    if (task)
+    {
+        victim->Unlink(task);
+        // keep its distance to min_vruntime, the clocks of two cpus are unrelated
+        if (task->policy == SCHED_FAIR)
+        {
+            int64_t lag = task->vruntime - victim->min_vruntime;
+            task->vruntime = lag < 0 && (uint64_t)-lag > this->min_vruntime ? 0 : this->min_vruntime + lag;
+        }
+        // moved before the unlock, a wakeup that takes the lock next goes to our cpu
+        // and no other cpu steals it before Schedule switches to it
+        task->cpu = this->cpu;
+        task->on_cpu = true;
+    }
+    victim->lock.unlock();
+    return task;
+}
+
+// called with interrupts disabled
+void Scheduler::Schedule()
+{
+    // the cpu has no tasks yet
+    if (this->idle == nullptr)
+        return;
+
     auto prev = current;
+    auto now = ktime_get_ns();
+    this->lock.lock();
+    this->need_resched = false;
+    if (prev != this->idle)
+    {
+        this->Account(prev, now);
+        // a task woken before it switched away is queued already
+        if (prev->state == TASK_RUNNING && !prev->on_rq)
+            this->Enqueue(prev);
+    }
+    auto next = this->Dequeue();
+    if (next && next->policy == SCHED_FAIR && next->vruntime > this->min_vruntime)
+        this->min_vruntime = next->vruntime;
+    // decided under the lock, Add kicks us when it sees the timer stopped
+    bool armed = this->nr_waiting > 0;
+    this->timer_armed = armed;
+    this->lock.unlock();
+
+    if (!next)
+        next = this->Steal();
+    if (!next)
+        next = this->idle;
+    next->exec_start = now;
+    this->running = next;
+
+    auto apic = APIC::GetInstance();
+    if (armed)
+        apic->TimerArm(now + SCHED_SLICE_US * NSEC_PER_USEC);
+    else
+        apic->TimerStop();
+    if (next == prev)
+        return;
+
+    // printk("from %d to %d\n", prev->pid, next->pid);
+    // cleared by __switch_to once prev is off its stack
+    next->on_cpu = true;
     asm volatile(
         "pushq	%rax	\n\t"
         "pushq	%rbp	\n\t"
@@ -62,31 +297,45 @@ void Scheduler::Schedule()
 
 Scheduler *Scheduler::Add(task_struct *task)
 {
-    if (this->next_task == nullptr)
+    bool kick = false;
+    this->lock.lock();
+    // stolen before we got the lock, Steal moves task->cpu under the lock of the cpu it leaves
+    if (task->cpu != this->cpu)
     {
-        this->next_task = task;
+        this->lock.unlock();
+        return CPU::GetInstance()->Get(task->cpu).scheduler.Add(task);
     }
-    // nothing happen when current == task
-    list_add_to_behind(&current->list, &task->list);
+    // on_cpu with the right cpu is fine, it runs here and Schedule takes it from the queue
+    if (!task->on_rq)
+    {
+        // sleeping earns a head start, not the whole time slept
+        auto floor = this->min_vruntime > SCHED_WAKEUP_BONUS ? this->min_vruntime - SCHED_WAKEUP_BONUS : 0;
+        if (task->policy == SCHED_FAIR && task->vruntime < floor)
+            task->vruntime = floor;
+        this->Enqueue(task);
+        // the next interrupt on this cpu switches to it, the kick makes sure one comes
+        // a stopped timer also needs Schedule to run once to start it
+        if (this->Preempts(task, this->running) || !this->timer_armed)
+        {
+            this->need_resched = true;
+            kick = true;
+        }
+    }
+    this->lock.unlock();
+
+    if (kick)
+        this->Kick();
+    // a busy cpu makes it wait, an idle one may take it
+    if (this->running != this->idle)
+        this->KickIdle();
     return this;
 }
 
 Scheduler *Scheduler::Remove(task_struct *task)
 {
-
-    auto next = this->next_task = (task_struct *)list_next(&current->list);
-    // if current is removed, the next task should be updated
-    if (current == task)
-    {
-        this->next_task = next;
-    }
-
-    // if there's not task to run, add idle task back
-    if (current == next)
-    {
-        this->next_task = init_task;
-    }
-
-    list_del(&task->list);
+    this->lock.lock();
+    if (task->on_rq)
+        this->Unlink(task);
+    this->lock.unlock();
     return this;
 }
@@ -2,18 +2,83 @@
 
 #include <std/stdint.h>
 #include <std/list.h>
+#include <std/rb_tree.h>
+#include <std/spinlock.h>
 #include "task.h"
 
+// weight of priority 0, each priority step weighs about 1.25 times more
+#define SCHED_WEIGHT_DEFAULT 1024
+#define SCHED_PRIORITY_MAX 19
+// how far behind min_vruntime a woken task may start, in ns
+// keeps sleepers ahead of cpu hogs without letting them bank their sleep
+#define SCHED_WAKEUP_BONUS (3 * 1000 * 1000UL)
+// a task runs this long before the timer lets the waiting ones in
+#define SCHED_SLICE_US 4000
+// rt levels, one bit each in rt_bitmap
+#define SCHED_RT_LEVELS 64
+#define SCHED_RT_PRIORITY_MAX (SCHED_RT_LEVELS - 1)
+
+// one per cpu, holds the runnable tasks waiting for that cpu
+// the running task is not on the runqueue
+// rt tasks wait in a fifo per priority and the most urgent one runs first
+// fair tasks are ordered by vruntime, the cpu time they got scaled by
+// their weight, and the lowest runs when no rt task waits
 class Scheduler
 {
 public:
+    // idle runs when the runqueue is empty and nothing can be stolen
+    void Init(task_struct *idle);
 
     void Schedule();
 
     Scheduler* Add(task_struct* task);
     Scheduler* Remove(task_struct* task);
 
+    // tasks waiting on the runqueue
+    uint64_t Waiting()
+    {
+        return this->nr_waiting;
+    }
+
+    // a woken task should run before the current one
+    bool NeedResched()
+    {
+        return this->need_resched;
+    }
+
+    // make the cpu of this runqueue call Schedule soon
+    void Kick();
+
 private:
-    friend void task_init();
-    task_struct *next_task = nullptr;
+    void Enqueue(task_struct *task);
+    task_struct *Dequeue();
+    // take a queued task off its queue
+    void Unlink(task_struct *task);
+    // task should run before running does
+    bool Preempts(task_struct *task, task_struct *running);
+    // charge task for the cycles since it was switched in
+    void Account(task_struct *task, uint64_t now);
+    // take a task another cpu has queued but not started
+    task_struct *Steal();
+    // wake one idle cpu so it steals from this runqueue
+    void KickIdle();
+
+    Spinlock lock;
+    // bit n set when rt_queues[n] is not empty
+    uint64_t rt_bitmap = 0;
+    List rt_queues[SCHED_RT_LEVELS];
+    RBTree runqueue;
+    volatile uint64_t nr_waiting = 0;
+    // only grows, wakeups and migrations are placed relative to it
+    uint64_t min_vruntime = 0;
+    task_struct *running = nullptr;
+    task_struct *idle = nullptr;
+    volatile bool need_resched = false;
+    // apic id of the cpu this runqueue belongs to
+    uint64_t cpu = 0;
+    // the timer runs only while tasks wait, an idle cpu takes no ticks
+    // with it stopped a new task has to Kick the cpu
+    volatile bool timer_armed = false;
 };
+
+void reschedule_ipi_handler(uint64_t error_code, uint64_t rsp, uint64_t rflags, uint64_t rip);
@@ -7,7 +7,9 @@
 #include <memory/physical.h>
 #include <std/interrupt.h>
 #include <memory/mapping.h>
+#include <memory/pcid.h>
 #include <memory/kmalloc.h>
+#include <memory/kmem_cache.h>
 #include "scheduler.h"
 #include "mutex.h"
 #include "condition_variable.h"
@@ -25,6 +27,16 @@ extern "C" void ret_syscall();
 
 task_struct *init_task;
 
+// task_struct itself stays at the base of its kernel stack, current is found from rsp
+static kmem_cache *thread_cache;
+static kmem_cache *mm_cache;
+
+void task_cache_init()
+{
+    thread_cache = kmem_cache_create("thread_struct", sizeof(thread_struct), 0, nullptr);
+    mm_cache = kmem_cache_create("mm_struct", sizeof(mm_struct), 0, nullptr);
+}
+
 static CPU *cpus;
 
 extern "C" unsigned long do_exit(unsigned long code)
@@ -50,8 +62,7 @@ static task_struct *do_fork(struct Regs *regs, unsigned long clone_flags)
     task->pid = global_pid++;
     task->state = TASK_UNINTERRUPTIBLE;
 
-    // place thread_struct after task_struct
-    auto thread = (struct thread_struct *)(task + 1);
+    auto thread = (struct thread_struct *)kmem_cache_alloc(thread_cache);
     bzero(thread, sizeof(struct thread_struct));
     task->thread = thread;
 
@@ -106,6 +117,7 @@ int vmap_copy_kernel(task_struct *task)
 {
     auto kernel_pml4 = (Page_PML4 *)Phy_To_Virt(&pml4);
     task->mm->pml4[511] = kernel_pml4[511];
+    task->mm->pml4[DIRECT_MAP_PML4_INDEX] = kernel_pml4[DIRECT_MAP_PML4_INDEX];
 }
 
 void userland_page_init(task_struct *task)
@@ -128,10 +140,10 @@ void init2()
     printk("this is init 2\n");
 
     auto task = current;
-    task->mm = (mm_struct *)((char *)task->thread + sizeof(thread_struct));
+    task->mm = (mm_struct *)kmem_cache_alloc(mm_cache);
     bzero(task->mm, sizeof(mm_struct));
     userland_page_init(task);
-    set_cr3(Virt_To_Phy(task->mm->pml4));
+    switch_mm(task->mm);
     memcpy((uint8_t *)task->mm->start_code, (uint8_t *)&userland_entry, 1024);
     auto ret_syscall_addr = uint64_t(&ret_syscall);
     auto ret_stack = uint64_t((uint8_t *)task + STACK_SIZE - sizeof(Regs));
@@ -212,88 +224,103 @@ uint64_t init(uint64_t arg)
     printk("current : %x\n", current);
     printk("bash_task : %x\n", bash_task);
 
-    this_cpu->scheduler.Add(current)->Add(bash_task);
+    task_run_on(bash_task, this_cpu->apic_id);
 
     sti();
     while (1)
     {
+        // no tick wakes an idle cpu, fill the pool before sleeping
+        while (PhysicalMemory::GetInstance()->RefillZeroedPool())
+            ;
         hlt();
     }
 }
 
-void task_init()
+// a task whose stack starts out running entry, it never exits
+static task_struct *create_idle_task(uint64_t entry)
 {
-
     auto page = PhysicalMemory::GetInstance()->Allocate(1, PG_PTable_Maped | PG_Kernel | PG_Active);
+    auto idle = (task_struct *)Phy_To_Virt(page->physical_address);
 
-    auto init_task_stack = (uint8_t *)(Phy_To_Virt(page->physical_address) + PAGE_4K_SIZE);
-
-    tss_struct init_task_tss;
-    bzero(&init_task_tss, sizeof(tss_struct));
-    init_task_tss.rsp0 = (uint64_t)init_task_stack;
-
-    set_tss(init_task_tss);
-
-    init_task = (task_struct *)Phy_To_Virt(page->physical_address);
-
-    memset(init_task, 0, STACK_SIZE);
+    memset(idle, 0, STACK_SIZE);
 
-    list_init(&init_task->list);
+    list_init(&idle->list);
 
-    init_task->state = TASK_UNINTERRUPTIBLE;
-    init_task->flags = PF_KTHREAD;
-    init_task->pid = global_pid++;
-    init_task->signal = 0;
-    init_task->priority = 0;
+    idle->state = TASK_UNINTERRUPTIBLE;
+    idle->flags = PF_KTHREAD;
+    idle->pid = global_pid++;
+    idle->signal = 0;
+    idle->priority = 0;
 
     // set mm and thread
 
-    init_task->mm = nullptr;
+    idle->mm = nullptr;
 
-    auto thread = (struct thread_struct *)(init_task + 1);
-    init_task->thread = thread;
+    auto thread = (struct thread_struct *)kmem_cache_alloc(thread_cache);
+    bzero(thread, sizeof(struct thread_struct));
+    idle->thread = thread;
     thread->fs = KERNEL_DS;
     thread->gs = KERNEL_DS;
-    thread->rsp0 = (uint64_t)init_task + STACK_SIZE;
-    thread->rsp = (uint64_t)init_task + STACK_SIZE - sizeof(Regs) - 0x8;
-    thread->rip = uint64_t(&init);
+    thread->rsp0 = (uint64_t)idle + STACK_SIZE;
+    thread->rsp = (uint64_t)idle + STACK_SIZE - sizeof(Regs) - 0x8;
+    thread->rip = entry;
     // the real stack points stack end - Regs
-    init_task->state = TASK_RUNNING;
+    idle->state = TASK_RUNNING;
+    return idle;
+}
+
+// leave the boot stack for the idle task, never returns
+static void start_idle_task(task_struct *idle)
+{
+    this_cpu->scheduler.Init(idle);
 
-    asm volatile("movq  %0, %%r15   \n\t"  ::"a"(init_task->thread->rip));
-    asm volatile("movq	%0,	%%rsp \n\t" ::"a"(init_task->thread->rsp));
-    asm volatile("movq	%0,	%%rbp \n\t" ::"a"(init_task->thread->rsp0));
+    asm volatile("movq  %0, %%r15   \n\t"  ::"a"(idle->thread->rip));
+    asm volatile("movq	%0,	%%rsp \n\t" ::"a"(idle->thread->rsp));
+    asm volatile("movq	%0,	%%rbp \n\t" ::"a"(idle->thread->rsp0));
     asm volatile("push  %r15 \n\t");
     asm volatile("retq");
 }
 
+void task_init()
+{
+    init_task = create_idle_task(uint64_t(&init));
+
+    tss_struct init_task_tss;
+    bzero(&init_task_tss, sizeof(tss_struct));
+    init_task_tss.rsp0 = init_task->thread->rsp0;
+
+    set_tss(init_task_tss);
+
+    start_idle_task(init_task);
+}
+
+void task_init_ap(void (*fn)())
+{
+    start_idle_task(create_idle_task(uint64_t(fn)));
+}
+
 extern "C" void __switch_to(struct task_struct *prev, struct task_struct *next)
 {
 
+    // we run on the stack of next now, prev may be picked up elsewhere
+    prev->on_cpu = false;
+
     auto &task_tss = get_tss();
     task_tss.rsp0 = next->thread->rsp0;
     set_tss(task_tss);
 
-    if (prev->mm == nullptr && next->mm)
-    {
-        // printk("kernel to userland\n");
-        set_cr3(Virt_To_Phy(next->mm->pml4));
-        flush_tlb();
-    }
-    else if (prev->mm && next->mm == nullptr)
-    {
-        // printk("userland to kernel\n");
-        set_cr3(&pml4);
-        flush_tlb();
-    }
+    // kernel threads have no mm and run on the kernel pml4
+    if (prev->mm != next->mm)
+        switch_mm(next->mm);
 }
 
 void task_sleep()
 {
     asm volatile("pushf");
     asm volatile("cli");
+    // not running, Schedule won't queue it again until it is woken
     current->state = TASK_STOPPED;
-    this_cpu->scheduler.Remove(current)->Schedule();
+    this_cpu->scheduler.Schedule();
     asm volatile("popf");
 }
 
@@ -310,6 +337,17 @@ void task_wakeup(task_struct *task)
     asm volatile("pushf");
     asm volatile("cli");
     task->state = TASK_RUNNING;
-    this_cpu->scheduler.Add(task);
+    // back to its own cpu, which may not have switched away from it yet
+    CPU::GetInstance()->Get(task->cpu).scheduler.Add(task);
+    asm volatile("popf");
+}
+
+void task_run_on(task_struct *task, uint64_t cpu)
+{
+    asm volatile("pushf");
+    asm volatile("cli");
+    task->cpu = cpu;
+    task->state = TASK_RUNNING;
+    CPU::GetInstance()->Get(cpu).scheduler.Add(task);
     asm volatile("popf");
 }
\ No newline at end of file
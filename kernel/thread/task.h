@@ -1,6 +1,7 @@
 #pragma once
 #include <std/stdint.h>
 #include <std/list.h>
+#include <std/rb_tree.h>
 #include <tss.h>
 #include <memory/virtual_page.h>
 
@@ -12,6 +13,11 @@
 
 #define PF_KTHREAD (1 << 0)
 
+// scheduling policies
+// SCHED_FAIR shares the cpu by weight, SCHED_RT always runs before it
+#define SCHED_FAIR 0
+#define SCHED_RT 1
+
 // task states
 #define TASK_RUNNING (1 << 0)
 #define TASK_INTERRUPTIBLE (1 << 1)
@@ -24,10 +30,18 @@
 #define CLONE_FILES (1 << 1)
 #define CLONE_SIGNAL (1 << 2)
 
+// words of mm_struct::cpu_mask, xapic ids are 8 bits
+#define CPU_MASK_WORDS 4
+
 struct mm_struct
 {
     Page_PML4* pml4; //page table point
     List physical_page_list;
+    // generation << PCID_SHIFT | pcid, the tlb tag of this address space while the
+    // generation is current, one word so both are always read together
+    volatile uint64_t pcid_tag;
+    // cpus whose tlb may hold entries of this mm, one bit per apic id
+    volatile uint64_t cpu_mask[CPU_MASK_WORDS];
     
     // all addresses below are virtual
     void* start_code;
@@ -72,12 +86,32 @@ struct task_struct
 
     uint64_t pid;
     uint64_t signal;
+    // SCHED_FAIR: 0 to SCHED_PRIORITY_MAX, a higher priority gets a larger share of the cpu
+    // SCHED_RT: 0 to SCHED_RT_PRIORITY_MAX, 0 is the most urgent, lower levels wait until it blocks
     uint64_t priority;
+    uint8_t policy;
+
+    // ns of cpu time weighted by priority, the runqueue is ordered by it
+    uint64_t vruntime;
+    // ktime when the task was last switched in or charged
+    uint64_t exec_start;
+    RBNode run_node;
+
+    // apic id of the cpu whose runqueue the task belongs to
+    uint64_t cpu;
+    // waiting on a runqueue, the running task is not
+    volatile bool on_rq;
+    // still on its cpu, nobody else may run it until __switch_to leaves it
+    volatile bool on_cpu;
 };
 
 constexpr uint64_t STACK_SIZE = 4096;
 
+// object caches for thread_struct and mm_struct, before any cpu creates a task
+void task_cache_init();
 void task_init();
+// make fn the idle task of this ap, never returns
+void task_init_ap(void (*fn)());
 task_struct *get_current_task();
 
 inline struct task_struct *get_current()
@@ -140,4 +174,6 @@ inline struct task_struct *get_current()
 
 void task_sleep();
 void task_yield();
-void task_wakeup(task_struct* task);
\ No newline at end of file
+void task_wakeup(task_struct* task);
+// queue a new task on the runqueue of cpu, idle cpus may still steal it
+void task_run_on(task_struct *task, uint64_t cpu);
\ No newline at end of file
@@ -0,0 +1,87 @@
+#include "ktime.h"
+#include <interrupt/pit.h>
+#include <rtc/rtc.h>
+#include <std/cpu_features.h>
+#include <std/msr.h>
+#include <std/printk.h>
+
+// long enough for the pit to give a few per mille of precision
+#define KTIME_CALIBRATE_MS 50
+// ns = cycles * mult >> KTIME_SHIFT
+#define KTIME_SHIFT 32
+
+static uint64_t tsc_base;
+static uint64_t tsc_khz;
+static uint64_t mult;
+static uint64_t boot_real_ns;
+
+// days from 1970-01-01 to year-month-day of the proleptic gregorian calendar
+static uint64_t days_from_civil(uint64_t year, uint64_t month, uint64_t day)
+{
+    // count years from march so the leap day ends the year
+    if (month <= 2)
+        year -= 1;
+    uint64_t era = year / 400;
+    uint64_t year_of_era = year - era * 400;
+    uint64_t day_of_year = (153 * (month > 2 ? month - 3 : month + 9) + 2) / 5 + day - 1;
+    uint64_t day_of_era = year_of_era * 365 + year_of_era / 4 - year_of_era / 100 + day_of_year;
+    return era * 146097 + day_of_era - 719468;
+}
+
+// rtc seconds since the epoch, read twice until both reads agree
+static uint64_t rtc_read_seconds()
+{
+    uint8_t second, minute, hour, day, month, year;
+    do
+    {
+        second = RTC::Second();
+        minute = RTC::Minute();
+        hour = RTC::Hour();
+        day = RTC::Day();
+        month = RTC::Month();
+        year = RTC::Year();
+    } while (second != RTC::Second() || minute != RTC::Minute() || hour != RTC::Hour() ||
+             day != RTC::Day() || month != RTC::Month() || year != RTC::Year());
+
+    auto days = days_from_civil(2000 + year, month, day);
+    return ((days * 24 + hour) * 60 + minute) * 60 + second;
+}
+
+void ktime_init()
+{
+    if (!cpu_has(CPU_FEATURE_INVARIANT_TSC))
+        printk("tsc is not invariant, ktime drifts with the cpu frequency\n");
+
+    auto start = rdtsc();
+    pit_spin(KTIME_CALIBRATE_MS);
+    tsc_khz = (rdtsc() - start) / KTIME_CALIBRATE_MS;
+    mult = (NSEC_PER_MSEC << KTIME_SHIFT) / tsc_khz;
+
+    // the rtc only has seconds, that is as good as the wall clock gets
+    boot_real_ns = rtc_read_seconds() * NSEC_PER_SEC;
+    tsc_base = rdtsc();
+    printk("ktime: tsc %u khz\n", tsc_khz);
+    RTC::PrintTime();
+}
+
+uint64_t ktime_get_ns()
+{
+    // 128 bit product, 64 bits of cycles times mult overflow within hours
+    return ((unsigned __int128)(rdtsc() - tsc_base) * mult) >> KTIME_SHIFT;
+}
+
+uint64_t ktime_get_real_ns()
+{
+    return boot_real_ns + ktime_get_ns();
+}
+
+uint64_t ktime_tsc_khz()
+{
+    return tsc_khz;
+}
+
+uint64_t ktime_ns_to_tsc(uint64_t ns)
+{
+    // split so ns * tsc_khz can't overflow, there is no 128 bit division
+    return tsc_base + ns / NSEC_PER_MSEC * tsc_khz + ns % NSEC_PER_MSEC * tsc_khz / NSEC_PER_MSEC;
+}
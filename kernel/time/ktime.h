@@ -0,0 +1,19 @@
+#pragma once
+
+#include <std/stdint.h>
+
+#define NSEC_PER_USEC 1000UL
+#define NSEC_PER_MSEC 1000000UL
+#define NSEC_PER_SEC 1000000000UL
+
+// calibrate the tsc against the pit and read the rtc once, before any other cpu starts
+void ktime_init();
+
+// nanoseconds since ktime_init, monotonic and the same on every cpu
+uint64_t ktime_get_ns();
+// nanoseconds since 1970-01-01 00:00:00 utc, the rtc at boot plus ktime_get_ns
+uint64_t ktime_get_real_ns();
+
+uint64_t ktime_tsc_khz();
+// the tsc value at ktime ns, for tsc deadline timers
+uint64_t ktime_ns_to_tsc(uint64_t ns);